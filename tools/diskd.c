@@ -25,12 +25,24 @@
   *  Ver.2.0  for Pacemaker 1.1.x
   */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* O_DIRECT */
+#endif
 #include <sys/param.h>
 
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/utsname.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <linux/netlink.h>
+#include <linux/aio_abi.h>
 #include <unistd.h>
 
 #include <stdlib.h>
@@ -39,6 +51,10 @@
 #include <libgen.h>
 #include <time.h>
 #include <string.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <scsi/sg.h>
 
 #include <crm/attrd.h>
 #include <crm/common/mainloop.h>
@@ -47,27 +63,280 @@
 #  include <getopt.h>
 #endif
 
-#define MIN_INTERVAL		1
-#define MAX_INTERVAL		3600
-#define MIN_TIMEOUT		1
-#define MAX_TIMEOUT		600
+#define MIN_INTERVAL		10		/* msec */
+#define MAX_INTERVAL		3600000
+#define MIN_TIMEOUT		10		/* msec */
+#define MAX_TIMEOUT		600000
 #define MIN_RETRY		0
 #define MAX_RETRY		10
-#define MIN_RETRY_INTERVAL	1
-#define MAX_RETRY_INTERVAL	3600
+#define MIN_RETRY_INTERVAL	10		/* msec */
+#define MAX_RETRY_INTERVAL	3600000
+#define MAX_STATS_INTERVAL	3600		/* sec */
+#define MIN_RETRY_BACKOFF	1
+#define MAX_RETRY_BACKOFF	10
+#define MIN_RETRY_JITTER	0
+#define MAX_RETRY_JITTER	100
+#define MIN_JITTER		0
+#define MAX_JITTER		50	/* percent of the interval */
+#define MIN_SLOW_THRESHOLD	0	/* msec, 0 disables the SLOW status */
+#define MAX_SLOW_THRESHOLD	MAX_TIMEOUT
+#define MIN_SLOW_WINDOW		1
+#define MAX_SLOW_WINDOW		1000
+#define ANOMALY_FACTOR		4	/* a check slower than 4 times the median is unusual */
+#define ANOMALY_MIN_CHECKS	10
+#define PASSIVE_MAX_SKIPS	4	/* checks in a row answered by the passive check */
+#define MIN_SAMPLES		1
+#define MAX_SAMPLES		64
+#define MAX_HYSTERESIS_WINDOW	64	/* bits of the check history */
 /* status */
 #define ERROR			1
 #define normal			-1
 #define NONE			2
+#define SLOW			3
 
 #define BLKFLSBUF		_IO(0x12,97) /* flush buffer. refer linux/hs.h */
+#define BLKGETSIZE64		_IOR(0x12,114,size_t) /* device size. refer linux/fs.h */
+#define BLKSSZGET		_IO(0x12,104) /* logical block size. refer linux/fs.h */
+#define SG_SENSE_LEN		32
+#define SCSI_STAT_BUSY		0x08	/* SAM status codes */
+#define SCSI_STAT_RESERVATION_CONFLICT	0x18
+#define SCSI_STAT_TASK_SET_FULL	0x28
+#define SCSI_DID_TIME_OUT	0x03	/* host status of a command timed out */
+#define IOPRIO_CLASS_SHIFT	13	/* refer linux/ioprio.h */
+#define IOPRIO_CLASS_RT		1
+#define IOPRIO_CLASS_BE		2
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_WHO_PROCESS	1
+#define IOPRIO_PRIO_VALUE(class, data)	(((class) << IOPRIO_CLASS_SHIFT) | (data))
+#define IOPRIO_LEVELS		8
 #define WRITE_DATA		64
+#define WRITE_SLOTS		16	/* pages of the preallocated file written in turn */
+#define CONTROL_REQUEST_MAX	64
+#define CONTROL_BACKLOG		16
+#define STATUS_MAGIC		0x6b736964	/* "disk" */
+#define STATUS_VERSION		1
+#define STATUS_NAME_LEN		64
+#define STATUS_STALE		10	/* sec without a heartbeat before a query fails */
+#define STATUS_READ_TRIES	1000
+#define EVENT_RING		1024	/* events kept for a dump */
 
 #define WRITE_DIR		"/tmp"
 #define WRITE_FILE		"diskcheck"
 #define PID_FILE		"/tmp/diskd.pid"
+#define DISKSTATS_FILE		"/proc/diskstats"
+#define MOUNTINFO_FILE		"/proc/self/mountinfo"
+#define UEVENT_BUFFER_SIZE	8192
+#define PEER_MAGIC		"diskdps1"
+#define PEER_SLOT_SIZE		4096
+#define PEER_NODE_LEN		64
+#define MAX_PEER_SLOTS		64	/* bits of the seen map */
+
+#define OPTARGS			"N:wd:a:i:p:DV?t:r:I:oem:T:s:l:L:R:US:W:b:j:f:M:J:c:F:g:PA:x:Eu:y:C:H:K:G:Y:Z:"
+
+/* phases of a check, timed separately */
+enum diskd_phase {
+	PHASE_OPEN,
+	PHASE_FLUSH,
+	PHASE_READ,
+	PHASE_WRITE,
+	PHASE_REMOVE,
+	PHASE_SYNC,
+	PHASE_TOTAL,
+	PHASE_MAX
+};
+static const char *phase_names[PHASE_MAX] = {
+	"open", "flush", "read", "write", "remove", "sync", "total"
+};
+
+/* state of the check of a target */
+enum diskd_state {
+	STATE_IDLE,
+	STATE_PROBING,		/* an attempt is running in the probe pool */
+	STATE_RETRY_WAIT,	/* waiting for the next attempt */
+};
+
+/* how the write check writes */
+enum diskd_write_mode {
+	WRITE_MODE_CREATE,	/* create, write and remove a file */
+	WRITE_MODE_PREALLOC,	/* rewrite a page of a preallocated file */
+	WRITE_MODE_DIRECT,	/* as WRITE_MODE_PREALLOC, with O_DIRECT */
+};
+
+enum diskd_scsi_probe {
+	SCSI_PROBE_NONE,	/* read through the block layer */
+	SCSI_PROBE_TUR,		/* TEST UNIT READY with SG_IO */
+	SCSI_PROBE_READ,	/* READ(16) of the first block with SG_IO */
+};
+
+#define HIST_SUB_BITS		3
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP		36	/* up to 2^36 usec, about 19 hours */
+#define HIST_BUCKETS		((HIST_MAX_EXP - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct diskd_hist_s {
+	guint64 count;
+	gint64 sum;		/* usec */
+	gint64 max;		/* usec */
+	guint32 bucket[HIST_BUCKETS];
+} diskd_hist_t;
+
+/* slot of a node in the peer area, little endian */
+typedef struct diskd_peer_slot_s {
+	char magic[8];		/* PEER_MAGIC */
+	guint64 seq;		/* incremented by every check of the owner */
+	gint64 time;		/* wall clock of the owner, for the reader of a dump */
+	guint64 seen;		/* slots the owner saw changing */
+	char node[PEER_NODE_LEN];
+} diskd_peer_slot_t;
+
+/* what we know of another slot */
+typedef struct diskd_peer_s {
+	gboolean known;
+	guint64 seq;
+	gint64 changed;		/* monotonic time seq was seen changing, 0 if never */
+	char *attr;
+	char *sees_attr;	/* nodes the peer sees */
+} diskd_peer_t;
+
+typedef struct diskd_target_s {
+	char *name;		/* attribute name */
+	char *spec;		/* specification the target was built from */
+	char *device;		/* device name for disk check (read) */
+	char *wdir;		/* directory name for disk check (write) */
+	char *wfile;		/* file name for disk check (write) */
+	int interval;		/* msec, as are all the intervals and the timeout */
+	int fast_interval;	/* interval after a bad or unusually slow check */
+	int max_interval;	/* interval reached while the checks are good */
+	int cur_interval;	/* interval in use */
+	gint64 check_start;	/* monotonic time the current check was due */
+	gint64 next_check;	/* monotonic time the next check is due */
+	guint phase_hash;	/* picks the offset of the checks within the interval */
+	int jitter;		/* percent of the interval the checks are varied by */
+	int timeout;
+	int retry;
+	int retry_interval;
+	int slow_threshold;	/* msec */
+	int slow_window;	/* number of checks */
+	int slow_percentile;
+	int fail_count;		/* ERROR is reported after fail_count failed checks */
+	int fail_window;	/* of the last fail_window ones */
+	int recover_count;	/* and cleared after recover_count good checks */
+	int recover_window;	/* of the last recover_window ones */
+	guint64 history;	/* bit 0 set if the last check failed, bit 1 the one before... */
+	int history_len;	/* checks in the history */
+	gboolean direct;	/* read with O_DIRECT instead of flushing the buffer cache */
+	int samples;		/* number of pages read across the device */
+	int scsi;		/* SCSI_PROBE_* */
+	int ioprio;		/* I/O priority of the check, -1 to keep the one of diskd */
+	gboolean check_paths;	/* also check each path of a multipath device */
+	gboolean paths_given;	/* paths=yes was set on the target itself */
+	GList *paths;		/* targets of the paths */
+	char *paths_attr;	/* attribute counting the healthy paths */
+	struct diskd_target_s *parent;	/* multipath device of a path */
+	gboolean passive;	/* sampled from the diskstats file */
+	dev_t rdev;
+	gint64 passive_at;	/* monotonic time of the last sample, 0 before the first */
+	guint64 passive_ios;	/* reads and writes completed */
+	guint64 passive_ticks;	/* io_ticks, msec the device was busy */
+	gint64 stall_since;	/* monotonic time requests stopped completing, 0 if not */
+	gboolean stall_reported;
+	gboolean passive_ok;	/* I/O completed since the last check without a stall */
+	gboolean active_ok;	/* the last check which issued I/O passed */
+	int passive_skips;	/* checks answered by the passive check since it */
+	char *mount_state;	/* mountinfo line of the write directory */
+	gint64 peer_offset;	/* start of the peer area on the device, -1 if not given */
+	int peer_slots;		/* number of slots, 0 if the peer slots are not used */
+	int peer_slot;		/* slot of this node */
+	int peer_timeout;	/* msec a peer may leave its slot unchanged */
+	guint64 peer_seq;
+	guint64 peer_seen;	/* map of the peers visible at the last check */
+	diskd_peer_t *peers;
+	char *peers_attr;
+	int write_mode;
+	int wfd;		/* preallocated file kept open, -1 if not open */
+	dev_t wdev;		/* identity of the file wfd refers to */
+	ino_t wino;
+	int wslot;		/* next page of the preallocated file to write */
+	guint64 wseq;		/* pages written to the preallocated file */
+	gint64 *window;		/* latency of the last slow_window checks, usec */
+	int window_pos;
+	int window_count;
+	const char *value;	/* last value sent to attrd */
+	guint timer_id;
+	void *ptr;		/* allocated buffer */
+	void *buf;		/* I/O buffer (page aligned for read) */
+	int state;		/* STATE_* */
+	int attempt;		/* attempt of the current check, 0 is the first one */
+	int retry_backoff;	/* factor the retry interval grows by per attempt */
+	int retry_jitter;	/* percent the retry interval is varied by at random */
+	guint retry_id;
+	gint64 probe_start;	/* monotonic time the check was started */
+	gint64 deadline;	/* monotonic time the watchdog reports ERROR */
+	int heap_index;		/* position in the watchdog heap, -1 if not armed */
+	diskd_hist_t hist[PHASE_MAX];	/* latency of each phase */
+	gint64 last_check;	/* wall clock time the last check ended */
+	guint64 checks;		/* checks ended */
+	guint64 errors;		/* checks ended in ERROR */
+	guint64 slows;		/* checks ended in SLOW */
+	guint64 retries;	/* attempts retried */
+	int slot;		/* record in the status file */
+	gboolean removed;	/* dropped by a reload while its check was running */
+	gboolean borrowed;	/* STATE_PROBING until the check of the target it replaced returns */
+} diskd_target_t;
+
+/* every attempt times each phase at most once, except for EAGAIN loops */
+#define PROBE_SAMPLES		((MAX_RETRY + 1) * PHASE_MAX)
+
+enum diskd_event_type {
+	EVENT_PROBE,		/* an attempt of a check ended */
+	EVENT_TIMEOUT,		/* the watchdog found a check running too long */
+	EVENT_STALL,		/* the passive check found requests not completing */
+	EVENT_ATTRD,		/* an update was sent to attrd */
+};
+
+typedef struct diskd_event_s {
+	gint64 time;		/* wall clock */
+	int type;		/* EVENT_* */
+	int attempt;
+	int result;		/* status of the attempt, or TRUE if attrd took the update */
+	int err;		/* first errno of a failed attempt */
+	const char *reason;	/* decoded SCSI failure */
+	gint32 usec[PHASE_MAX];	/* time of each phase, -1 if not run */
+	char name[STATUS_NAME_LEN];
+	char value[8];		/* value sent to attrd */
+} diskd_event_t;
+
+/* layout of the status file */
+typedef struct diskd_shm_slot_s {
+	volatile guint32 seq;	/* odd while the record is being written */
+	gint32 status;		/* normal, ERROR, SLOW or NONE before the first check */
+	gint64 last_check;	/* wall clock time the last check ended */
+	guint64 checks;
+	guint64 errors;
+	char name[STATUS_NAME_LEN];
+} diskd_shm_slot_t;
+
+typedef struct diskd_shm_head_s {
+	guint32 magic;
+	guint32 version;
+	volatile guint32 seq;
+	guint32 ntargets;
+	gint64 pid;
+	gint64 heartbeat;	/* monotonic time, renewed every second */
+	diskd_shm_slot_t slot[];
+} diskd_shm_head_t;
 
-#define OPTARGS			"N:wd:a:i:p:DV?t:r:I:oem:"
+typedef struct diskd_probe_s {
+	diskd_target_t *target;
+	int result;		/* normal or ERROR */
+	int err;		/* first errno seen in the attempt */
+	const char *reason;	/* decoded SCSI failure */
+	int nsamples;
+	struct {
+		int phase;
+		gint64 usec;
+	} samples[PROBE_SAMPLES];
+} diskd_probe_t;
 
 GMainLoop* mainloop = NULL;
 const char *diskd_attr = "diskd";
@@ -76,21 +345,59 @@ const char *attr_set = NULL;
 const char *attr_dampen = NULL;
 
 const char *device = NULL;	/* device name for disk check */
-const char *wdir = NULL;
-char *wfile = NULL;		/* directory name for disk check (write) 2008.10.24 */
+const char *wdir = NULL;	/* directory name for disk check (write) 2008.10.24 */
 gboolean wflag = FALSE;
 int optflag = 0;		/* flag for duplicate */
 
 int retry = 1;			/* disk check retry. default 1 times */
-int retry_interval = 5;		/* disk check retry intarval time. default 5sec. */
-int interval = 30;		/* disk check interval. default 30sec.*/
-int timeout = 60;		/* disk check read func timeout. default 60sec. */
+int retry_interval = 5000;	/* disk check retry intarval time. default 5sec. */
+int retry_backoff = 1;		/* retry interval growth per attempt. default 1 (constant). */
+int retry_jitter = 0;		/* retry interval random variation in percent. default 0. */
+int interval = 30000;		/* disk check interval. default 30sec.*/
+int fast_interval = 0;		/* interval after a bad check. default 0 (same as interval). */
+int max_interval = 0;		/* interval while healthy. default 0 (same as interval). */
+int check_jitter = 0;		/* check time random variation in percent. default 0. */
+int timeout = 60000;		/* disk check read func timeout. default 60sec. */
+int slow_threshold = 0;		/* latency to report SLOW. default off. */
+int slow_window = 10;		/* checks to take the latency percentile of. default 10. */
+int fail_count = 1;		/* failed checks of fail_window to report ERROR. default 1 of 1. */
+int fail_window = 1;
+int recover_count = 1;		/* good checks of recover_window to clear ERROR. default 1 of 1. */
+int recover_window = 1;
+gboolean direct_read = FALSE;	/* read with O_DIRECT. default off. */
+int samples = 1;		/* pages read per check. default 1 (the first page only). */
+int scsi_probe = SCSI_PROBE_NONE;	/* check with SG_IO. default off. */
+int io_priority = -1;		/* I/O priority of the checks. default that of diskd. */
+static int default_ioprio = 0;	/* I/O priority of diskd */
+static gboolean ioprio_used = FALSE;
+static cpu_set_t probe_cpus;	/* CPUs of the probe and watchdog threads */
+static gboolean probe_cpus_set = FALSE;
+int watchdog_fifo = 0;		/* SCHED_FIFO priority of the watchdog. default 0 (off). */
+gboolean check_paths = FALSE;	/* check the paths of a multipath device. default off. */
+int passive_interval = 0;	/* msec between samples of the diskstats file. default off. */
+char *diskstats_path = NULL;	/* default DISKSTATS_FILE */
+gboolean events_flag = FALSE;	/* check on uevents and mount changes. default off. */
+char *uevent_path = NULL;	/* socket to take uevents from instead of netlink */
+char *mountinfo_path = NULL;	/* default MOUNTINFO_FILE */
+static int uevent_fd = -1;
+static int mountinfo_fd = -1;
+int write_mode = WRITE_MODE_CREATE;
 int oneshot_flag = 0;
 int exec_thread_flag = 0;
-const char *diskcheck_value = NULL;
+int stats_interval = 0;		/* interval to log the latency statistics. default off. */
+int refresh_interval = 600;	/* interval to resend unchanged attributes. default 600sec. */
+char *control_path = NULL;	/* control socket. default none. */
+static int control_fd = -1;
+char *status_path = NULL;	/* status file. default none. */
+static diskd_shm_head_t *status_map = NULL;
+static size_t status_size = 0;
+static guint status_heartbeat_id = 0;
+static diskd_event_t event_ring[EVENT_RING];
+static guint64 event_count = 0;
 int pagesize = 0;
-void *ptr = NULL;
-void *buf;
+GList *targets = NULL;		/* list of diskd_target_t */
+GList *target_specs = NULL;	/* -T options, kept for a reload */
+char *config_path = NULL;	/* file of target specifications. default none. */
 
 #if PACEMAKER_GE_1113
 int attr_options = attrd_opt_none;
@@ -100,38 +407,52 @@ gboolean attr_options = FALSE;
 
 #if GLIB_CHECK_VERSION(2, 32, 0)
 GMutex diskd_mutex;
-GCond diskd_cond;
-GMutex thread_start_mutex;
-GCond thread_start_cond;
+GMutex watchdog_mutex;
+GCond watchdog_cond;
 #else
 static GMutex *diskd_mutex = NULL;		/* Thread Mutex */
-static GCond *diskd_cond = NULL;		/* Thread Cond */
-static GMutex *thread_start_mutex = NULL;	/* Thread Start Mutex */
-static GCond *thread_start_cond = NULL;		/* Thread Start Cond */
+static GMutex *watchdog_mutex = NULL;		/* Watchdog Mutex */
+static GCond *watchdog_cond = NULL;		/* Watchdog Cond */
 #endif
 static gboolean diskd_thread_use = FALSE;	/* Tthred Timer Flag */
-static GThread *th_timer = NULL;		/* Thread Timer */
-static int timer_id = -1;
+static GThread *th_watchdog = NULL;		/* Watchdog Thread */
+static gboolean watchdog_stop = FALSE;
+static diskd_target_t **watchdog_heap = NULL;	/* min-heap of armed deadlines */
+static int watchdog_heap_len = 0;
+static int watchdog_heap_size = 0;
+static GThreadPool *probe_pool = NULL;		/* Threads running the disk checks */
+static GHashTable *attr_sent = NULL;		/* attribute name -> value sent to attrd */
+static GHashTable *attr_pending = NULL;		/* attribute name -> value to send */
+static guint flush_id = 0;
 
 static void diskd_thread_timer_init(void);
-static void diskd_thread_create(void);
+static void diskd_watchdog_arm(diskd_target_t *target);
 static void diskd_thread_timer_variable_free(void);
-static void diskd_thread_condsend(void);
+static void diskd_watchdog_disarm(diskd_target_t *target);
 static void diskd_thread_timer_end(void);
-void send_update(void);
+gboolean send_update(const char *name, const char *value);
+gboolean send_delete(const char *name);
 void crm_make_daemon(const char *name, gboolean daemonize, const char *pidfile);
 
 static void
 diskd_shutdown(int nsig)
 {
+	GList *gIter;
+
 	crm_info("Exiting");
 
-	if (timer_id != -1) {
-		g_source_remove(timer_id);
-		timer_id = -1;
-	}
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
 
-	diskd_thread_condsend();
+		if (target->timer_id != 0) {
+			g_source_remove(target->timer_id);
+			target->timer_id = 0;
+		}
+		if (target->retry_id != 0) {
+			g_source_remove(target->retry_id);
+			target->retry_id = 0;
+		}
+	}
 
 	if (mainloop != NULL && g_main_is_running(mainloop)) {
 		g_main_quit(mainloop);
@@ -146,7 +467,7 @@ usage(const char *cmd, int crm_exit_status)
 	FILE *stream;
 	stream = crm_exit_status ? stderr : stdout;
 
-	fprintf(stream, "usage: %s (-N|-w) [-daipDV?trIoem]\n", cmd);
+	fprintf(stream, "usage: %s (-N|-w|-T|-C) [-daipDV?trIoemTCslLHKGYZRUSWbjfMJcFgPAxEuy]\n", cmd);
 	fprintf(stream, "\nBasic options\n");
 	fprintf(stream, "    --%s (-%c) <device>\tDevice name to read\n"
 		"\t\t\t\t\t * Required option\n", "read-device-name", 'N');
@@ -157,7 +478,18 @@ usage(const char *cmd, int crm_exit_status)
 	fprintf(stream, "    --%s (-%c) <string>\t\tName of the node attribute to set\n"
 		"\t\t\t\t\t * Default=diskd\n", "attr-name", 'a');
 	fprintf(stream, "    --%s (-%c) <time[s]>\t\tDisk status check interval time\n"
-		"\t\t\t\t\t * Default=30 sec.\n", "interval", 'i');
+		"\t\t\t\t\t * Default=30 sec.\n"
+		"\t\t\t\t\t * Times may be given in msec as <time>ms\n", "interval", 'i');
+	fprintf(stream, "    --%s (-%c) <time[s]>\tInterval after an error, SLOW or unusually\n"
+		"\t\t\t\t\tslow check, doubled back while checks are good\n"
+		"\t\t\t\t\t * Default=same as interval\n", "fast-interval", 'f');
+	fprintf(stream, "    --%s (-%c) <time[s]>\tInterval reached while checks stay good\n"
+		"\t\t\t\t\t * Default=same as interval\n", "max-interval", 'M');
+	fprintf(stream, "    --%s (-%c) <percent>\t\tVary each check time at random by this\n"
+		"\t\t\t\t\tpercent of the interval\n"
+		"\t\t\t\t\t * Default=0 percent\n"
+		"\t\t\t\t\t * Checks are also offset within the interval by\n"
+		"\t\t\t\t\t   a hash of the node and attribute names\n", "jitter", 'J');
 	fprintf(stream, "    --%s (-%c) <file>\t\tFile in which to store the process' PID\n"
 		"\t\t\t\t\t * Default=%s\n", "pid-file", 'p', PID_FILE);
 	fprintf(stream, "    --%s (-%c)\t\t\tRun in daemon mode\n", "daemonize", 'D');
@@ -168,32 +500,134 @@ usage(const char *cmd, int crm_exit_status)
 		"\t\t\t\t\t * Invalid at the time of the oneshot parameter designation\n", "exec-thread", 'e');
 	fprintf(stream, "    --%s (-%c) <time[s]>\t\tDampening interval\n"
 		"\t\t\t\t\t * Default=0 sec.\n", "dampen", 'm');
+	fprintf(stream, "    --%s (-%c) <spec>\t\tAdditional target to check (may be repeated)\n"
+		"\t\t\t\t\t * <spec> is a comma separated list of key=value:\n"
+		"\t\t\t\t\t   device=<device> or write-dir=<directory>,\n"
+		"\t\t\t\t\t   name, interval, fast-interval, max-interval,\n"
+		"\t\t\t\t\t   timeout, retry, retry-interval,\n"
+		"\t\t\t\t\t   retry-backoff, retry-jitter, jitter,\n"
+		"\t\t\t\t\t   slow-threshold, slow-window, slow-percentile,\n"
+		"\t\t\t\t\t   fail-window=<n>/<m>, recover-window=<n>/<m>,\n"
+		"\t\t\t\t\t   ioprio=rt|be[:<level>]|idle|none,\n"
+		"\t\t\t\t\t   read-mode=flush|direct|tur|read16, samples,\n"
+		"\t\t\t\t\t   paths=yes|no,\n"
+		"\t\t\t\t\t   peer-offset, peer-slots, peer-slot, peer-timeout\n"
+		"\t\t\t\t\t   write-mode=create|prealloc|direct\n"
+		"\t\t\t\t\t * Omitted keys take the value of the options\n"
+		"\t\t\t\t\t   (slow-percentile defaults to 99)\n"
+		"\t\t\t\t\t * peer-slots=<n> writes slot peer-slot of n %d byte\n"
+		"\t\t\t\t\t   slots from byte peer-offset of the device, which\n"
+		"\t\t\t\t\t   must be reserved for it, and reads all of them\n"
+		"\t\t\t\t\t   to set <attr-name>_peer_<node> and <attr-name>_peers,\n"
+		"\t\t\t\t\t   and <attr-name>_peer_<node>_sees to the nodes\n"
+		"\t\t\t\t\t   that peer sees\n",
+		"target", 'T', PEER_SLOT_SIZE);
+	fprintf(stream, "    --%s (-%c) <file>\t\tFile of targets, one <spec> as given to -T\n"
+		"\t\t\t\t\tper line, '#' starts a comment\n"
+		"\t\t\t\t\t * SIGHUP reads it again: unchanged targets go\n"
+		"\t\t\t\t\t   on as they are, changed ones restart their\n"
+		"\t\t\t\t\t   checks and removed ones delete their attributes\n"
+		"\t\t\t\t\t * Default=none\n", "config-file", 'C');
+	fprintf(stream, "    --%s (-%c) <time[s]>\tInterval to log the latency of each check phase\n"
+		"\t\t\t\t\t * Default=0 (only at exit)\n", "stats-interval", 's');
+	fprintf(stream, "    --%s (-%c) <time[s]>\tInterval to resend unchanged attributes\n"
+		"\t\t\t\t\t * Default=600 sec. (0 sends changes only)\n", "refresh-interval", 'R');
+	fprintf(stream, "    --%s (-%c) <path>\tUnix socket serving the status, counters and\n"
+		"\t\t\t\t\tlatency of each target\n"
+		"\t\t\t\t\t * Send \"metrics\" (Prometheus text), \"json\"\n"
+		"\t\t\t\t\t   or \"events\" (the same as SIGUSR1 logs)\n"
+		"\t\t\t\t\t * \"rescan\" reads the mount table again\n"
+		"\t\t\t\t\t * Default=none\n", "control-socket", 'c');
+	fprintf(stream, "    --%s (-%c) <file>\t\tShared file holding the status of each target\n"
+		"\t\t\t\t\t * Default=none\n", "status-file", 'F');
+	fprintf(stream, "    --%s (-%c) <file>\t\tPrint the status in the status file of a\n"
+		"\t\t\t\t\trunning diskd and exit, as the only option\n"
+		"\t\t\t\t\t * Exit 0 if running, 1 if not answering,\n"
+		"\t\t\t\t\t   7 if not running\n", "query", 'Q');
 	fprintf(stream, "    --%s (-%c)\t\t\t\tThis text\n", "help", '?');
-	fprintf(stream, "\nNote: -N, -w options cannot be specified at the same time.\n\n");
+	fprintf(stream, "\nNote: -N, -w options cannot be specified at the same time.\n");
+	fprintf(stream, "      Each target must have its own attribute name.\n\n");
 	fprintf(stream, "Advanced options\n");
-	fprintf(stream, "    --%s (-%c) <time[s]>\tDisk status check timeout for select function\n"
-		"\t\t\t\t\t * Default=60 sec.\n", "check-timeout", 't');
+	fprintf(stream, "    --%s (-%c) <time[s]>\tDisk status check timeout\n"
+		"\t\t\t\t\t * Default=60 sec.\n"
+		"\t\t\t\t\t * A check running longer is reported as ERROR\n", "check-timeout", 't');
 	fprintf(stream, "    --%s (-%c) <times>\t\tDisk status check retry\n"
 		"\t\t\t\t\t * Default=1 times\n", "retry", 'r');
 	fprintf(stream, "    --%s (-%c) <time[s]>\tDisk status check retry interval time\n"
 		"\t\t\t\t\t * Default=5 sec.\n", "retry-interval", 'I');
+	fprintf(stream, "    --%s (-%c) <factor>\tMultiply the retry interval by this per retry\n"
+		"\t\t\t\t\t * Default=1 (constant)\n", "retry-backoff", 'b');
+	fprintf(stream, "    --%s (-%c) <percent>\tVary the retry interval at random by this\n"
+		"\t\t\t\t\t * Default=0 percent\n", "retry-jitter", 'j');
+	fprintf(stream, "    --%s (-%c)\t\t\tRead the device with O_DIRECT instead of\n"
+		"\t\t\t\t\tflushing its buffer cache before every check\n", "direct-read", 'U');
+	fprintf(stream, "    --%s (-%c) <tur|read16>\tSend TEST UNIT READY or READ(16) of the first\n"
+		"\t\t\t\t\tblock to the device with SG_IO, bypassing the\n"
+		"\t\t\t\t\tblock layer queue\n"
+		"\t\t\t\t\t * The check timeout is the command timeout\n", "scsi-probe", 'g');
+	fprintf(stream, "    --%s (-%c)\t\t\tAlso check each path of a multipath device\n"
+		"\t\t\t\t\t * A path sets <attr-name>_<path>, and\n"
+		"\t\t\t\t\t   <attr-name>_paths counts the healthy paths\n", "check-paths", 'P');
+	fprintf(stream, "    --%s (-%c) <time>\tSample the I/O counters of the devices\n"
+		"\t\t\t\t\t * Requests not completing for the check timeout\n"
+		"\t\t\t\t\t   are reported as ERROR, and a check is skipped\n"
+		"\t\t\t\t\t   when the device has completed I/O since the last\n"
+		"\t\t\t\t\t   one, while it is normal\n"
+		"\t\t\t\t\t * Failed requests count as completed too, so at\n"
+		"\t\t\t\t\t   most %d checks in a row are skipped\n"
+		"\t\t\t\t\t * Default=0 (off)\n", "passive-interval", 'A', PASSIVE_MAX_SKIPS);
+	fprintf(stream, "    --%s (-%c) <file>\tFile to sample the I/O counters from\n"
+		"\t\t\t\t\t * Default=%s\n", "diskstats-file", 'x', DISKSTATS_FILE);
+	fprintf(stream, "    --%s (-%c)\t\t\tCheck a target at once on a uevent of its\n"
+		"\t\t\t\t\tdevice or paths, or a change of the file system\n"
+		"\t\t\t\t\tof its write directory\n", "events", 'E');
+	fprintf(stream, "    --%s (-%c) <path>\tTake uevents from datagrams sent to this\n"
+		"\t\t\t\t\tsocket instead of the kernel\n", "uevent-socket", 'u');
+	fprintf(stream, "    --%s (-%c) <file>\tMount table to watch\n"
+		"\t\t\t\t\t * Default=%s\n", "mountinfo-file", 'y', MOUNTINFO_FILE);
+	fprintf(stream, "    --%s (-%c) <pages>\t\tPages to read per check, spread over the device\n"
+		"\t\t\t\t\t * More than 1 are read together with O_DIRECT\n"
+		"\t\t\t\t\t * Default=1 (the first page only)\n", "samples", 'S');
+	fprintf(stream, "    --%s (-%c) <mode>\t\tHow to write for the write check\n"
+		"\t\t\t\t\t * create: create, write and remove %s\n"
+		"\t\t\t\t\t * prealloc: keep %s preallocated and open,\n"
+		"\t\t\t\t\t   rewrite one of its pages and fdatasync\n"
+		"\t\t\t\t\t * direct: as prealloc, with O_DIRECT\n"
+		"\t\t\t\t\t * Default=create\n", "write-mode", 'W', WRITE_FILE, WRITE_FILE);
+	fprintf(stream, "    --%s (-%c) <time[s]>\tReport SLOW when the 99th percentile latency\n"
+		"\t\t\t\t\tof the last checks exceeds this\n"
+		"\t\t\t\t\t * e.g. 200ms\n"
+		"\t\t\t\t\t * Default=0 (off)\n", "slow-threshold", 'l');
+	fprintf(stream, "    --%s (-%c) <checks>\tNumber of checks for the SLOW percentile\n"
+		"\t\t\t\t\t * Default=10 checks\n", "slow-window", 'L');
+	fprintf(stream, "    --%s (-%c) <n>/<m>\t\tReport ERROR only once n of the last m checks\n"
+		"\t\t\t\t\thave failed, up to m=%d\n"
+		"\t\t\t\t\t * Each interval a check stays past its timeout\n"
+		"\t\t\t\t\t   counts as a failed check, and so does the\n"
+		"\t\t\t\t\t   check when it returns with an error\n"
+		"\t\t\t\t\t * Default=1/1 (the first failed check)\n",
+		"fail-window", 'H', MAX_HYSTERESIS_WINDOW);
+	fprintf(stream, "    --%s (-%c) <n>/<m>\tClear ERROR only once n of the last m checks\n"
+		"\t\t\t\t\thave passed\n"
+		"\t\t\t\t\t * Default=1/1 (the first good check)\n", "recover-window", 'K');
+	fprintf(stream, "    --%s (-%c) <class>\t\tI/O priority of the checks: rt[:<level>],\n"
+		"\t\t\t\t\tbe[:<level>] or idle, level 0 (highest) to 7\n"
+		"\t\t\t\t\t * rt keeps the checks ahead of the queued\n"
+		"\t\t\t\t\t   writes of applications with bfq\n"
+		"\t\t\t\t\t * Default=none (that of diskd)\n", "io-priority", 'G');
+	fprintf(stream, "    --%s (-%c) <cpus>\t\tCPUs to run the checks and the watchdog on,\n"
+		"\t\t\t\t\te.g. 0,2-3\n"
+		"\t\t\t\t\t * Default=all\n", "cpu-affinity", 'Y');
+	fprintf(stream, "    --%s (-%c) <priority>\tRun the watchdog of -e with SCHED_FIFO\n"
+		"\t\t\t\t\tat this priority (1 to 99)\n"
+		"\t\t\t\t\t * Default=0 (off)\n", "watchdog-fifo", 'Z');
 
 	fflush(stream);
 	crm_exit(crm_exit_status);
 }
 
-static gboolean
-check_status(int new_status)
+static void diskd_status_lock(void)
 {
-	if (oneshot_flag) { /* oneshot */
-		return FALSE;
-	}
-
-	if (new_status != ERROR && new_status != normal) {
-		crm_warn("non-defined status, new_status = %d", new_status);
-		return FALSE;
-	}
-
 	if (diskd_thread_use == TRUE) {
 #if GLIB_CHECK_VERSION(2, 32, 0)
 		g_mutex_lock(&diskd_mutex);
@@ -201,16 +635,10 @@ check_status(int new_status)
 		g_mutex_lock(diskd_mutex);
 #endif
 	}
+}
 
-	if (new_status == ERROR) {
-		diskcheck_value = "ERROR";
-		crm_warn("disk status is changed, attr_name=%s, target=%s, new_status=%s",
-			diskd_attr, (wflag)? wdir : device, diskcheck_value);
-	} else {
-		diskcheck_value = "normal";
-	}
-	send_update();
-
+static void diskd_status_unlock(void)
+{
 	if (diskd_thread_use == TRUE) {
 #if GLIB_CHECK_VERSION(2, 32, 0)
 		g_mutex_unlock(&diskd_mutex);
@@ -218,385 +646,3602 @@ check_status(int new_status)
 		g_mutex_unlock(diskd_mutex);
 #endif
 	}
-	return TRUE;
 }
 
-static void diskd_thread_timer_init()
+/*
+ * Event ring.  The last EVENT_RING probe attempts, watchdog timeouts and
+ * attrd updates are kept in a fixed array, overwriting the oldest, and
+ * are only formatted when dumped by SIGUSR1 or the control socket.
+ */
+static diskd_event_t *diskd_event_next(int type, const char *name)
 {
-	if (exec_thread_flag == 0) return;
+	diskd_event_t *ev = &event_ring[event_count % EVENT_RING];
 
-#if GLIB_CHECK_VERSION(2, 32, 0)
-	/*
-	 * When g_mutex_init() and g_cond_init() fails, it will call abort().
-	 * https://git.gnome.org/browse/glib/tree/glib/gthread-posix.c?h=glib-2-32
-	 */
-	g_mutex_init(&thread_start_mutex);
-	g_cond_init(&thread_start_cond);
-	g_mutex_init(&diskd_mutex);
-	g_cond_init(&diskd_cond);
+	event_count++;
+	memset(ev, 0, sizeof(*ev));
+	ev->time = g_get_real_time();
+	ev->type = type;
+	g_strlcpy(ev->name, name, sizeof(ev->name));
+	return ev;
+}
 
-	diskd_thread_use = TRUE;
-#else
-	if (g_thread_supported()) {
-		crm_warn("The thread timer of diskd is not supported. By this system,"
-			" I/O blocking may occur by a check of diskd in read/write.");
-		return;
+static void diskd_event_probe(diskd_probe_t *probe)
+{
+	diskd_event_t *ev;
+	int i;
+
+	diskd_status_lock();
+	ev = diskd_event_next(EVENT_PROBE, probe->target->name);
+	ev->attempt = probe->target->attempt;
+	ev->result = probe->result;
+	ev->err = (probe->result == ERROR)? probe->err : 0;
+	ev->reason = (probe->result == ERROR)? probe->reason : NULL;
+	for (i = 0; i < PHASE_MAX; i++) {
+		ev->usec[i] = -1;
 	}
-	g_thread_init(NULL);
-	thread_start_mutex = g_mutex_new();
-	thread_start_cond = g_cond_new();
-	diskd_mutex = g_mutex_new();
-	diskd_cond = g_cond_new();
+	for (i = 0; i < probe->nsamples; i++) {
+		int phase = probe->samples[i].phase;
+
+		ev->usec[phase] = MAX(ev->usec[phase], 0) + probe->samples[i].usec;
+	}
+	diskd_status_unlock();
+}
+
+static void diskd_event_timeout(diskd_target_t *target)
+{
+	diskd_event_t *ev;
 
-	if (diskd_mutex && diskd_cond && thread_start_mutex && thread_start_cond) {
-		diskd_thread_use = TRUE;
+	diskd_status_lock();
+	ev = diskd_event_next(EVENT_TIMEOUT, target->name);
+	ev->attempt = target->attempt;
+	ev->result = ERROR;
+	diskd_status_unlock();
+}
+
+static void diskd_event_stall(diskd_target_t *target)
+{
+	diskd_event_t *ev;
+
+	diskd_status_lock();
+	ev = diskd_event_next(EVENT_STALL, target->name);
+	ev->result = ERROR;
+	diskd_status_unlock();
+}
+
+/* called with the status lock held */
+static void diskd_event_attrd(const char *name, const char *value, gboolean sent)
+{
+	diskd_event_t *ev = diskd_event_next(EVENT_ATTRD, name);
+
+	ev->result = sent;
+	g_strlcpy(ev->value, value, sizeof(ev->value));
+}
+
+static void diskd_event_format(GString *out, diskd_event_t *ev)
+{
+	time_t sec = ev->time / G_TIME_SPAN_SECOND;
+	struct tm tm;
+	char stamp[32];
+	int phase;
+
+	localtime_r(&sec, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+	g_string_append_printf(out, "%s.%06d %s", stamp,
+		(int)(ev->time % G_TIME_SPAN_SECOND), ev->name);
+
+	if (ev->type == EVENT_ATTRD) {
+		g_string_append_printf(out, " attrd value=%s %s", ev->value,
+			(ev->result)? "sent" : "failed");
+	} else if (ev->type == EVENT_TIMEOUT) {
+		g_string_append_printf(out, " timeout attempt=%d", ev->attempt);
+	} else if (ev->type == EVENT_STALL) {
+		g_string_append(out, " stall");
 	} else {
-		diskd_thread_timer_variable_free();
-		crm_warn("Failed in the generation of the thread variable."
-			" The thread timer is not available.");
+		g_string_append_printf(out, " probe attempt=%d result=%s", ev->attempt,
+			(ev->result == ERROR)? "ERROR" : (ev->result == SLOW)? "SLOW" : "normal");
+		if (ev->err) {
+			g_string_append_printf(out, " errno=%d(%s)", ev->err, strerror(ev->err));
+		}
+		if (ev->reason) {
+			g_string_append_printf(out, " scsi=\"%s\"", ev->reason);
+		}
+		for (phase = 0; phase < PHASE_MAX; phase++) {
+			if (ev->usec[phase] >= 0) {
+				g_string_append_printf(out, " %s=%dus", phase_names[phase], ev->usec[phase]);
+			}
+		}
 	}
-#endif
+	g_string_append_c(out, '\n');
 }
 
-static void diskd_thread_timer_variable_free()
+/* oldest first */
+static void diskd_event_dump(GString *out)
 {
-#if GLIB_CHECK_VERSION(2, 32, 0)
-	g_mutex_clear(&diskd_mutex);
-	g_mutex_clear(&thread_start_mutex);
-	g_cond_clear(&diskd_cond);
-	g_cond_clear(&thread_start_cond);
-#else
-	if (diskd_mutex != NULL) {
-		g_mutex_free(diskd_mutex);
-		diskd_mutex = NULL;
+	guint64 i;
+
+	diskd_status_lock();
+	i = (event_count > EVENT_RING)? event_count - EVENT_RING : 0;
+	for (; i < event_count; i++) {
+		diskd_event_format(out, &event_ring[i % EVENT_RING]);
+	}
+	diskd_status_unlock();
+}
+
+static void diskd_event_log(int nsig)
+{
+	GString *out = g_string_sized_new(EVENT_RING * 128);
+	char *line;
+	char *next;
+
+	diskd_event_dump(out);
+	crm_notice("Dumping %d recorded events", (int)MIN(event_count, EVENT_RING));
+	for (line = out->str; *line != '\0'; line = next) {
+		next = strchr(line, '\n');
+		*next++ = '\0';
+		crm_notice("event: %s", line);
+	}
+	g_string_free(out, TRUE);
+}
+
+/*
+ * Status file.  The daemon keeps the status of every target in a small
+ * shared file, so a monitor can read it without running a check.  Each
+ * record is guarded by a sequence count which is odd while the record is
+ * being written; a reader retries until it sees the same even count
+ * before and after its copy.
+ */
+static void diskd_seq_begin(volatile guint32 *seq)
+{
+	(*seq)++;
+	__sync_synchronize();
+}
+
+static void diskd_seq_end(volatile guint32 *seq)
+{
+	__sync_synchronize();
+	(*seq)++;
+}
+
+/* copy a record, FALSE if it does not hold still */
+static gboolean diskd_seq_read(const volatile guint32 *seq, const void *src, void *dst, size_t len)
+{
+	guint32 start;
+	int i;
+
+	for (i = 0; i < STATUS_READ_TRIES; i++) {
+		start = *seq;
+		__sync_synchronize();
+		memcpy(dst, src, len);
+		__sync_synchronize();
+		if ((start & 1) == 0 && start == *seq) {
+			return TRUE;
+		}
 	}
-	if (thread_start_mutex != NULL) {
-		g_mutex_free(thread_start_mutex);
-		thread_start_mutex = NULL;
+	return FALSE;
+}
+
+/* called with the status lock held */
+static void diskd_status_publish(diskd_target_t *target, int status)
+{
+	diskd_shm_slot_t *slot;
+
+	if (status_map == NULL) {
+		return;
+	}
+	slot = &status_map->slot[target->slot];
+	diskd_seq_begin(&slot->seq);
+	slot->status = status;
+	slot->last_check = target->last_check;
+	slot->checks = target->checks;
+	slot->errors = target->errors;
+	diskd_seq_end(&slot->seq);
+}
+
+static gboolean diskd_status_heartbeat(gpointer data)
+{
+	if (status_map == NULL) {
+		return TRUE;
 	}
-	if (diskd_cond != NULL) {
-		g_cond_free(diskd_cond);
-		diskd_cond = NULL;
+	diskd_seq_begin(&status_map->seq);
+	status_map->heartbeat = g_get_monotonic_time();
+	diskd_seq_end(&status_map->seq);
+	return TRUE;
+}
+
+/*
+ * The file is built aside and renamed into place, readers never see it
+ * half made.  A reload builds it again for the new targets.
+ */
+static gboolean diskd_status_file_open(void)
+{
+	char *tmp = g_strdup_printf("%s.XXXXXX", status_path);
+	diskd_shm_head_t *map = NULL;
+	diskd_shm_head_t *old = status_map;
+	size_t old_size = status_size;
+	size_t size;
+	GList *gIter;
+	int fd;
+	int n = 0;
+
+	size = sizeof(diskd_shm_head_t) + g_list_length(targets) * sizeof(diskd_shm_slot_t);
+	fd = mkstemp(tmp);
+	if (fd < 0 || fchmod(fd, 0644) < 0 || ftruncate(fd, size) < 0) {
+		crm_perror(LOG_ERR, "Could not create the status file %s", tmp);
+		goto err;
 	}
-	if (thread_start_cond != NULL) {
-		g_cond_free(thread_start_cond);
-		thread_start_cond = NULL;
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		crm_perror(LOG_ERR, "Could not map the status file %s", tmp);
+		map = NULL;
+		goto err;
 	}
-#endif
+	map->magic = STATUS_MAGIC;
+	map->version = STATUS_VERSION;
+	map->pid = getpid();
+	map->heartbeat = g_get_monotonic_time();
+
+	diskd_status_lock();
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+		diskd_shm_slot_t *slot = &map->slot[n++];
+
+		if (target->value == NULL) {
+			slot->status = NONE;
+		} else if (strcmp(target->value, "ERROR") == 0) {
+			slot->status = ERROR;
+		} else if (strcmp(target->value, "SLOW") == 0) {
+			slot->status = SLOW;
+		} else {
+			slot->status = normal;
+		}
+		slot->last_check = target->last_check;
+		slot->checks = target->checks;
+		slot->errors = target->errors;
+		g_strlcpy(slot->name, target->name, STATUS_NAME_LEN);
+	}
+	map->ntargets = n;
+	if (rename(tmp, status_path) < 0) {
+		diskd_status_unlock();
+		crm_perror(LOG_ERR, "Could not rename %s to %s", tmp, status_path);
+		munmap(map, size);
+		goto err;
+	}
+	n = 0;
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		target->slot = n++;
+	}
+	status_map = map;
+	status_size = size;
+	diskd_status_unlock();
+
+	close(fd);
+	g_free(tmp);
+	if (old) {
+		munmap(old, old_size);
+	}
+	if (status_heartbeat_id == 0) {
+		status_heartbeat_id = g_timeout_add_seconds(1, diskd_status_heartbeat, NULL);
+	}
+	return TRUE;
+
+err:
+	if (fd >= 0) {
+		close(fd);
+		unlink(tmp);
+	}
+	g_free(tmp);
+	return FALSE;
+}
+
+static void diskd_status_file_close(void)
+{
+	diskd_shm_head_t *map;
+
+	diskd_status_lock();
+	map = status_map;
+	status_map = NULL;
+	diskd_status_unlock();
+	if (map) {
+		unlink(status_path);
+		munmap(map, status_size);
+	}
+}
+
+/*
+ * Print the status published by a running daemon.
+ * Returns 0 if it is running, 1 if it has stopped answering, and
+ * 7 (OCF_NOT_RUNNING) if it is not running.
+ */
+static int diskd_query(const char *path)
+{
+	static const char *names[] = { "unknown", "normal", "ERROR", "SLOW" };
+	const diskd_shm_head_t *map;
+	diskd_shm_head_t head;
+	diskd_shm_slot_t slot;
+	struct stat st;
+	gint64 now = g_get_real_time();
+	int fd;
+	int rc = 0;
+	guint32 i;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return 7;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(diskd_shm_head_t)) {
+		close(fd);
+		return 7;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return 7;
+	}
+	if (diskd_seq_read(&map->seq, map, &head, sizeof(head)) == FALSE
+	    || head.magic != STATUS_MAGIC || head.version != STATUS_VERSION
+	    || st.st_size < sizeof(head) + head.ntargets * sizeof(diskd_shm_slot_t)) {
+		fprintf(stderr, "%s is not a diskd status file\n", path);
+		munmap((void *)map, st.st_size);
+		return 1;
+	}
+	if (kill(head.pid, 0) < 0 && errno == ESRCH) {
+		munmap((void *)map, st.st_size);
+		return 7;
+	}
+	if (g_get_monotonic_time() - head.heartbeat > STATUS_STALE * G_TIME_SPAN_SECOND) {
+		fprintf(stderr, "diskd (pid %d) has not updated %s for %d sec or more\n",
+			(int)head.pid, path, STATUS_STALE);
+		rc = 1;
+	}
+	for (i = 0; i < head.ntargets; i++) {
+		if (diskd_seq_read(&map->slot[i].seq, &map->slot[i], &slot, sizeof(slot)) == FALSE) {
+			rc = 1;
+			continue;
+		}
+		slot.name[STATUS_NAME_LEN - 1] = '\0';
+		printf("%s %s", slot.name,
+			names[(slot.status == normal)? 1 : (slot.status == ERROR)? 2
+				: (slot.status == SLOW)? 3 : 0]);
+		if (slot.last_check > 0) {
+			printf(" last_check=%llds checks=%llu errors=%llu",
+				(long long)((now - slot.last_check) / G_TIME_SPAN_SECOND),
+				(unsigned long long)slot.checks, (unsigned long long)slot.errors);
+		}
+		printf("\n");
+	}
+	munmap((void *)map, st.st_size);
+	return rc;
+}
+
+/*
+ * Updates to attrd are only sent when a value changes, and all the
+ * updates queued until the main loop is idle are flushed together.
+ */
+static gboolean diskd_flush_updates(gpointer data)
+{
+	GHashTable *batch;
+	GHashTableIter iter;
+	gpointer name, value;
+
+	diskd_status_lock();
+	batch = attr_pending;
+	attr_pending = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+	flush_id = 0;
+	diskd_status_unlock();
+
+	g_hash_table_iter_init(&iter, batch);
+	while (g_hash_table_iter_next(&iter, &name, &value)) {
+		gboolean sent = send_update(name, value);
+
+		diskd_status_lock();
+		if (sent) {
+			g_hash_table_replace(attr_sent, strdup(name), strdup(value));
+		}
+		diskd_event_attrd(name, value, sent);
+		diskd_status_unlock();
+	}
+	g_hash_table_destroy(batch);
+	return FALSE;
+}
+
+static void diskd_queue_update(const char *name, const char *value)
+{
+	const char *sent;
+
+	diskd_status_lock();
+	sent = g_hash_table_lookup(attr_sent, name);
+	if (sent == NULL || strcmp(sent, value) != 0) {
+		g_hash_table_replace(attr_pending, strdup(name), strdup(value));
+		if (flush_id == 0) {
+			flush_id = g_idle_add(diskd_flush_updates, NULL);
+		}
+	}
+	diskd_status_unlock();
+}
+
+/*
+ * Delete every attribute at exit: those of the config file, the paths
+ * and the peers as well as the one the resource agent knows of, so that
+ * no stale value is left behind in the CIB.
+ */
+static void diskd_delete_attrs(void)
+{
+	GHashTableIter iter;
+	gpointer name, value;
+	GList *names = NULL;
+	GList *gIter;
+
+	diskd_status_lock();
+	g_hash_table_iter_init(&iter, attr_sent);
+	while (g_hash_table_iter_next(&iter, &name, &value)) {
+		names = g_list_prepend(names, strdup(name));
+	}
+	g_hash_table_iter_init(&iter, attr_pending);
+	while (g_hash_table_iter_next(&iter, &name, &value)) {
+		if (g_hash_table_lookup(attr_sent, name) == NULL) {
+			names = g_list_prepend(names, strdup(name));
+		}
+	}
+	diskd_status_unlock();
+
+	for (gIter = names; gIter != NULL; gIter = gIter->next) {
+		crm_info("Deleting attribute %s", (char *)gIter->data);
+		send_delete(gIter->data);
+	}
+	g_list_free_full(names, free);
+}
+
+/* resend every attribute, in case attrd has lost it */
+static gboolean diskd_refresh_updates(gpointer data)
+{
+	GHashTableIter iter;
+	gpointer name, value;
+
+	diskd_status_lock();
+	g_hash_table_iter_init(&iter, attr_sent);
+	while (g_hash_table_iter_next(&iter, &name, &value)) {
+		if (g_hash_table_lookup(attr_pending, name) == NULL) {
+			g_hash_table_insert(attr_pending, strdup(name), strdup(value));
+		}
+	}
+	if (flush_id == 0 && g_hash_table_size(attr_pending) > 0) {
+		flush_id = g_idle_add(diskd_flush_updates, NULL);
+	}
+	diskd_status_unlock();
+	return TRUE;
+}
+
+/* count the healthy paths of a multipath device for its attribute */
+static void diskd_paths_update(diskd_target_t *parent)
+{
+	GList *gIter;
+	char value[16];
+	int healthy = 0;
+
+	diskd_status_lock();
+	for (gIter = parent->paths; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *path = gIter->data;
+
+		if (path->value && strcmp(path->value, "ERROR") != 0) {
+			healthy++;
+		}
+	}
+	diskd_status_unlock();
+	g_snprintf(value, sizeof(value), "%d", healthy);
+	diskd_queue_update(parent->paths_attr, value);
+}
+
+/* names of the nodes in a seen map, "node1,node2" */
+static void diskd_peer_names(diskd_target_t *target, guint64 map, GString *out)
+{
+	int i;
+
+	g_string_truncate(out, 0);
+	for (i = 0; i < target->peer_slots; i++) {
+		diskd_peer_slot_t *slot = (diskd_peer_slot_t *)((char *)target->buf + i * PEER_SLOT_SIZE);
+
+		if ((map & (G_GUINT64_CONSTANT(1) << i)) == 0) {
+			continue;
+		}
+		if (out->len > 0) {
+			g_string_append_c(out, ',');
+		}
+		slot->node[sizeof(slot->node) - 1] = '\0';
+		if (memcmp(slot->magic, PEER_MAGIC, sizeof(slot->magic)) == 0 && slot->node[0]) {
+			g_string_append(out, slot->node);
+		} else {
+			g_string_append_printf(out, "slot%d", i);
+		}
+	}
+}
+
+/*
+ * A peer is visible while its sequence number keeps changing; the clocks
+ * of the nodes are not compared.  A slot is only taken as a peer once it
+ * has been seen to change.  Sets <attr-name>_peer_<node> of each peer to
+ * 1 or 0 and <attr-name>_peers to the number of visible peers.  A visible
+ * peer also sets <attr-name>_peer_<node>_sees to the nodes it sees itself,
+ * so a partition of the nodes shows from any of them.
+ */
+static void diskd_peers_update(diskd_target_t *target)
+{
+	gint64 now = g_get_monotonic_time();
+	guint64 seen = 0;
+	GString *names = g_string_sized_new(256);
+	char value[16];
+	char buf[PATH_MAX];
+	int visible = 0;
+	int i;
+
+	for (i = 0; i < target->peer_slots; i++) {
+		diskd_peer_slot_t *slot = (diskd_peer_slot_t *)((char *)target->buf + i * PEER_SLOT_SIZE);
+		diskd_peer_t *peer = &target->peers[i];
+		guint64 seq;
+		gboolean alive;
+
+		if (i == target->peer_slot || memcmp(slot->magic, PEER_MAGIC, sizeof(slot->magic)) != 0) {
+			continue;
+		}
+		seq = GUINT64_FROM_LE(slot->seq);
+		if (peer->known && seq != peer->seq) {
+			peer->changed = now;
+		}
+		peer->known = TRUE;
+		peer->seq = seq;
+		if (peer->attr == NULL) {
+			slot->node[sizeof(slot->node) - 1] = '\0';
+			g_snprintf(buf, sizeof(buf), "%s_peer_%s", target->name,
+				(slot->node[0])? slot->node : "unknown");
+			peer->attr = strdup(buf);
+			g_snprintf(buf, sizeof(buf), "%s_sees", peer->attr);
+			peer->sees_attr = strdup(buf);
+		}
+
+		alive = (peer->changed != 0
+			 && now - peer->changed <= (gint64)target->peer_timeout * G_TIME_SPAN_MILLISECOND);
+		if (alive) {
+			seen |= G_GUINT64_CONSTANT(1) << i;
+			visible++;
+		}
+		diskd_queue_update(peer->attr, (alive)? "1" : "0");
+		if (alive) {	/* the map of a peer which stopped is stale */
+			diskd_peer_names(target, GUINT64_FROM_LE(slot->seen), names);
+			diskd_queue_update(peer->sees_attr, (names->len)? names->str : "none");
+		}
+	}
+	g_string_free(names, TRUE);
+	target->peer_seen = seen;
+	g_snprintf(value, sizeof(value), "%d", visible);
+	diskd_queue_update(target->peers_attr, value);
+}
+
+static gboolean
+check_status(diskd_target_t *target, int new_status)
+{
+	const char *value;
+
+	if (oneshot_flag) { /* oneshot */
+		return FALSE;
+	}
+
+	if (new_status != ERROR && new_status != normal && new_status != SLOW) {
+		crm_warn("non-defined status, new_status = %d", new_status);
+		return FALSE;
+	}
+
+	diskd_status_lock();
+	if (new_status == ERROR) {
+		target->value = "ERROR";
+		crm_warn("disk status is changed, attr_name=%s, target=%s, new_status=%s",
+			target->name, (target->wfile)? target->wdir : target->device, target->value);
+	} else if (new_status == SLOW) {
+		target->value = "SLOW";
+	} else {
+		target->value = "normal";
+	}
+	value = target->value;
+	diskd_status_publish(target, new_status);
+	diskd_status_unlock();
+
+	diskd_queue_update(target->name, value);
+	if (target->parent) {
+		diskd_paths_update(target->parent);
+	}
+	return TRUE;
+}
+
+static int diskd_history_count(guint64 history, int window)
+{
+	if (window < MAX_HYSTERESIS_WINDOW) {
+		history &= (G_GUINT64_CONSTANT(1) << window) - 1;
+	}
+	return __builtin_popcountll(history);
+}
+
+/*
+ * Hysteresis.  ERROR is reported once fail_count of the last fail_window
+ * checks have failed, and cleared once recover_count of the last
+ * recover_window checks have passed; until then the reported status
+ * stays.  A target which has not passed a check yet stays NONE, nothing
+ * is reported for it.  With record FALSE the result is only looked at,
+ * for a check which has not ended yet.  Called with the status lock held.
+ */
+static int diskd_hysteresis(diskd_target_t *target, int result, gboolean record)
+{
+	guint64 history = (target->history << 1) | (result == ERROR);
+	int len = MIN(target->history_len + 1, MAX_HYSTERESIS_WINDOW);
+	int fails;
+
+	if (record) {
+		target->history = history;
+		target->history_len = len;
+	}
+	if (target->value && strcmp(target->value, "ERROR") == 0) {
+		int good = MIN(len, target->recover_window)
+			- diskd_history_count(history, target->recover_window);
+
+		return (good >= target->recover_count)? result : ERROR;
+	}
+	if (result != ERROR) {
+		return result;
+	}
+	fails = diskd_history_count(history, target->fail_window);
+	if (fails >= target->fail_count) {
+		return ERROR;
+	}
+	crm_notice("%s failed %d of the last %d check(s), ERROR needs %d",
+		target->name, fails, MIN(len, target->fail_window), target->fail_count);
+	if (target->value == NULL) {
+		return NONE;
+	}
+	return (strcmp(target->value, "SLOW") == 0)? SLOW : normal;
+}
+
+/* report the result of a check through the hysteresis */
+static void diskd_report(diskd_target_t *target, int result, gboolean record)
+{
+	int status;
+
+	diskd_status_lock();
+	status = diskd_hysteresis(target, result, record);
+	diskd_status_unlock();
+	if (status == ERROR && result != ERROR) {
+		crm_info("%s is still reported as ERROR, clearing it needs %d good check(s) of %d",
+			target->name, target->recover_count, target->recover_window);
+	}
+	if (status != NONE) {
+		check_status(target, status);
+	}
+}
+
+static void diskd_watchdog_swap(int a, int b)
+{
+	diskd_target_t *tmp = watchdog_heap[a];
+
+	watchdog_heap[a] = watchdog_heap[b];
+	watchdog_heap[b] = tmp;
+	watchdog_heap[a]->heap_index = a;
+	watchdog_heap[b]->heap_index = b;
+}
+
+static void diskd_watchdog_sift_up(int i)
+{
+	while (i > 0 && watchdog_heap[(i - 1) / 2]->deadline > watchdog_heap[i]->deadline) {
+		diskd_watchdog_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void diskd_watchdog_sift_down(int i)
+{
+	while (1) {
+		int min = i;
+		int l = 2 * i + 1;
+		int r = 2 * i + 2;
+
+		if (l < watchdog_heap_len && watchdog_heap[l]->deadline < watchdog_heap[min]->deadline) {
+			min = l;
+		}
+		if (r < watchdog_heap_len && watchdog_heap[r]->deadline < watchdog_heap[min]->deadline) {
+			min = r;
+		}
+		if (min == i) {
+			return;
+		}
+		diskd_watchdog_swap(i, min);
+		i = min;
+	}
+}
+
+static void diskd_watchdog_remove(diskd_target_t *target)
+{
+	int i = target->heap_index;
+
+	watchdog_heap_len--;
+	if (i != watchdog_heap_len) {
+		watchdog_heap[i] = watchdog_heap[watchdog_heap_len];
+		watchdog_heap[i]->heap_index = i;
+		diskd_watchdog_sift_down(i);
+		diskd_watchdog_sift_up(i);
+	}
+	target->heap_index = -1;
+}
+
+/*
+ * The probe threads come and go with the pool and run the checks of every
+ * target in turn, so the CPUs and the I/O priority are set for each check.
+ * Every request of a check, the sampled reads submitted with io_submit()
+ * included, is issued by the probe thread itself and takes its priority.
+ * The I/O priority only matters to schedulers which have classes, e.g. bfq.
+ */
+static void diskd_thread_affinity(void)
+{
+	static gboolean warned = FALSE;
+
+	if (probe_cpus_set == FALSE) {
+		return;
+	}
+	if (sched_setaffinity(0, sizeof(probe_cpus), &probe_cpus) < 0 && warned == FALSE) {
+		crm_perror(LOG_WARNING, "Could not set the CPU affinity of a thread");
+		warned = TRUE;
+	}
+}
+
+static void diskd_set_ioprio(diskd_target_t *target)
+{
+	static gboolean warned = FALSE;
+	int prio = (target->ioprio >= 0)? target->ioprio : default_ioprio;
+
+	if (ioprio_used == FALSE) {
+		return;
+	}
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, prio) < 0 && warned == FALSE) {
+		crm_perror(LOG_WARNING, "Could not set the I/O priority of the check of %s",
+			target->name);
+		warned = TRUE;
+	}
+}
+
+/* the watchdog mostly sleeps, SCHED_FIFO lets it report on time under load */
+static void diskd_watchdog_setup(void)
+{
+	struct sched_param param;
+	int rc;
+
+	diskd_thread_affinity();
+	if (watchdog_fifo == 0) {
+		return;
+	}
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = watchdog_fifo;
+	rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (rc != 0) {
+		crm_warn("Could not run the watchdog with SCHED_FIFO priority %d: %s",
+			watchdog_fifo, strerror(rc));
+	}
+}
+
+/*
+ * The watchdog is one long-lived thread which waits for the earliest
+ * deadline of all running checks.  When a deadline passes before the
+ * check is finished, it reports ERROR like the former per-check thread.
+ * It keeps watchdog_mutex while reporting, so a disarmed target is never
+ * reported afterwards.
+ */
+static gpointer diskd_watchdog_func(gpointer data)
+{
+	diskd_watchdog_setup();
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	g_mutex_lock(&watchdog_mutex);
+#else
+	g_mutex_lock(watchdog_mutex);
+#endif
+	while (watchdog_stop == FALSE) {
+		diskd_target_t *target;
+		gint64 now = g_get_monotonic_time();
+
+		if (watchdog_heap_len == 0) {
+#if GLIB_CHECK_VERSION(2, 32, 0)
+			g_cond_wait(&watchdog_cond, &watchdog_mutex);
+#else
+			g_cond_wait(watchdog_cond, watchdog_mutex);
+#endif
+			continue;
+		}
+
+		target = watchdog_heap[0];
+		if (target->deadline > now) {
+#if GLIB_CHECK_VERSION(2, 32, 0)
+			g_cond_wait_until(&watchdog_cond, &watchdog_mutex, target->deadline);
+#else
+			GTimeVal gtime;
+
+			g_get_current_time(&gtime);
+			g_time_val_add(&gtime, target->deadline - now);
+			g_cond_timed_wait(watchdog_cond, watchdog_mutex, &gtime);
+#endif
+			continue;
+		}
+
+		diskd_watchdog_remove(target);
+		crm_warn("Timeout Error(s) occurred in diskd timer thread. attr_name=%s", target->name);
+		diskd_event_timeout(target);
+		diskd_report(target, ERROR, FALSE);
+	}
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	g_mutex_unlock(&watchdog_mutex);
+#else
+	g_mutex_unlock(watchdog_mutex);
+#endif
+	return NULL;
+}
+
+static void diskd_thread_timer_init()
+{
+	GError *gerr = NULL;
+
+	if (exec_thread_flag == 0) return;
+
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	/*
+	 * When g_mutex_init() and g_cond_init() fails, it will call abort().
+	 * https://git.gnome.org/browse/glib/tree/glib/gthread-posix.c?h=glib-2-32
+	 */
+	g_mutex_init(&diskd_mutex);
+	g_mutex_init(&watchdog_mutex);
+	g_cond_init(&watchdog_cond);
+
+	th_watchdog = g_thread_try_new("watchdog", diskd_watchdog_func, NULL, &gerr);
+#else
+	if (g_thread_supported()) {
+		crm_warn("The thread timer of diskd is not supported. By this system,"
+			" I/O blocking may occur by a check of diskd in read/write.");
+		return;
+	}
+	g_thread_init(NULL);
+	diskd_mutex = g_mutex_new();
+	watchdog_mutex = g_mutex_new();
+	watchdog_cond = g_cond_new();
+
+	if (!(diskd_mutex && watchdog_mutex && watchdog_cond)) {
+		diskd_thread_timer_variable_free();
+		crm_warn("Failed in the generation of the thread variable."
+			" The thread timer is not available.");
+		return;
+	}
+	th_watchdog = g_thread_create(diskd_watchdog_func, NULL, TRUE, &gerr);
+#endif
+	if (th_watchdog == NULL) {
+		crm_err("Cannot create diskd watchdog thread. %s", gerr->message);
+		g_error_free(gerr);
+		diskd_thread_timer_variable_free();
+		return;
+	}
+	diskd_thread_use = TRUE;
+}
+
+static void diskd_thread_timer_variable_free()
+{
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	g_mutex_clear(&diskd_mutex);
+	g_mutex_clear(&watchdog_mutex);
+	g_cond_clear(&watchdog_cond);
+#else
+	if (diskd_mutex != NULL) {
+		g_mutex_free(diskd_mutex);
+		diskd_mutex = NULL;
+	}
+	if (watchdog_mutex != NULL) {
+		g_mutex_free(watchdog_mutex);
+		watchdog_mutex = NULL;
+	}
+	if (watchdog_cond != NULL) {
+		g_cond_free(watchdog_cond);
+		watchdog_cond = NULL;
+	}
+#endif
+	g_free(watchdog_heap);
+	watchdog_heap = NULL;
+	watchdog_heap_len = watchdog_heap_size = 0;
+}
+
+static void diskd_thread_timer_end()
+{
+	if (diskd_thread_use == FALSE) return;
+
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	g_mutex_lock(&watchdog_mutex);
+	watchdog_stop = TRUE;
+	g_cond_signal(&watchdog_cond);
+	g_mutex_unlock(&watchdog_mutex);
+#else
+	g_mutex_lock(watchdog_mutex);
+	watchdog_stop = TRUE;
+	g_cond_signal(watchdog_cond);
+	g_mutex_unlock(watchdog_mutex);
+#endif
+	g_thread_join(th_watchdog);
+	th_watchdog = NULL;
+	diskd_thread_use = FALSE;
+
+	diskd_thread_timer_variable_free();
+}
+
+static void diskd_watchdog_arm(diskd_target_t *target)
+{
+	if (diskd_thread_use == FALSE) return;
+
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	g_mutex_lock(&watchdog_mutex);
+#else
+	g_mutex_lock(watchdog_mutex);
+#endif
+	if (target->heap_index >= 0) {
+		diskd_watchdog_remove(target);
+	}
+	if (watchdog_heap_len == watchdog_heap_size) {
+		watchdog_heap_size = (watchdog_heap_size)? watchdog_heap_size * 2 : 16;
+		watchdog_heap = g_renew(diskd_target_t *, watchdog_heap, watchdog_heap_size);
+	}
+	target->deadline = target->probe_start + (gint64)target->timeout * G_TIME_SPAN_MILLISECOND;
+	target->heap_index = watchdog_heap_len;
+	watchdog_heap[watchdog_heap_len++] = target;
+	diskd_watchdog_sift_up(target->heap_index);
+
+	if (target->heap_index == 0) {
+		/* the earliest deadline has changed */
+#if GLIB_CHECK_VERSION(2, 32, 0)
+		g_cond_signal(&watchdog_cond);
+#else
+		g_cond_signal(watchdog_cond);
+#endif
+	}
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	g_mutex_unlock(&watchdog_mutex);
+#else
+	g_mutex_unlock(watchdog_mutex);
+#endif
+}
+
+static void diskd_watchdog_disarm(diskd_target_t *target)
+{
+	if (diskd_thread_use == FALSE) return;
+
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	g_mutex_lock(&watchdog_mutex);
+	if (target->heap_index >= 0) {
+		diskd_watchdog_remove(target);
+	}
+	g_mutex_unlock(&watchdog_mutex);
+#else
+	g_mutex_lock(watchdog_mutex);
+	if (target->heap_index >= 0) {
+		diskd_watchdog_remove(target);
+	}
+	g_mutex_unlock(watchdog_mutex);
+#endif
+}
+
+/*
+ * Latency histograms.
+ * Values are kept in usec with 3 significant bits (at most 12.5% error),
+ * like HdrHistogram: the buckets double in width every 8 buckets.
+ */
+static int diskd_hist_index(gint64 usec)
+{
+	int e;
+
+	if (usec < HIST_SUB) {
+		return (usec < 0)? 0 : (int)usec;
+	}
+	e = g_bit_storage((gulong)usec) - 1;
+	if (e >= HIST_MAX_EXP) {
+		return HIST_BUCKETS - 1;
+	}
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB + (int)(usec >> (e - HIST_SUB_BITS)) - HIST_SUB;
+}
+
+/* the highest value which falls into the bucket */
+static gint64 diskd_hist_upper(int index)
+{
+	int shift;
+
+	if (index < HIST_SUB) {
+		return index;
+	}
+	shift = index / HIST_SUB - 1;
+	return (((gint64)(index % HIST_SUB + HIST_SUB) + 1) << shift) - 1;
+}
+
+static void diskd_hist_add(diskd_hist_t *hist, gint64 usec)
+{
+	hist->bucket[diskd_hist_index(usec)]++;
+	hist->count++;
+	hist->sum += usec;
+	if (usec > hist->max) {
+		hist->max = usec;
+	}
+}
+
+static gint64 diskd_hist_quantile(const diskd_hist_t *hist, double q)
+{
+	guint64 rank;
+	guint64 seen = 0;
+	int i;
+
+	if (hist->count == 0) {
+		return 0;
+	}
+	rank = (guint64)(q * hist->count);
+	if (rank == 0 || (double)rank < q * hist->count) {
+		rank++;
+	}
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->bucket[i];
+		if (seen >= rank) {
+			return MIN(diskd_hist_upper(i), hist->max);
+		}
+	}
+	return hist->max;
+}
+
+/* called right after each system call of a check, errno is still the one it set */
+static void diskd_probe_record(diskd_probe_t *probe, int phase, gint64 start)
+{
+	if (probe->err == 0) {
+		probe->err = errno;
+	}
+	if (probe->nsamples < PROBE_SAMPLES) {
+		probe->samples[probe->nsamples].phase = phase;
+		probe->samples[probe->nsamples].usec = g_get_monotonic_time() - start;
+		probe->nsamples++;
+	}
+}
+
+static gboolean diskd_stats_log(gpointer data)
+{
+	GList *gIter;
+	int phase;
+
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		for (phase = 0; phase < PHASE_MAX; phase++) {
+			diskd_hist_t *hist = &target->hist[phase];
+
+			if (hist->count == 0) {
+				continue;
+			}
+			crm_info("latency attr_name=%s phase=%s count=%llu"
+				" p50=%lldus p99=%lldus max=%lldus",
+				target->name, phase_names[phase], (unsigned long long)hist->count,
+				(long long)diskd_hist_quantile(hist, 0.50),
+				(long long)diskd_hist_quantile(hist, 0.99),
+				(long long)hist->max);
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Control socket.  A client sends one command line and gets the answer,
+ * then the connection is closed:
+ *   metrics	status, counters and latency in Prometheus text format
+ *   json	the same in JSON
+ *   events	the recorded probe events, oldest first
+ *   rescan	read the mount table again, as if it had changed
+ * An empty line is taken as "metrics".
+ */
+typedef struct diskd_client_s {
+	int fd;
+	char request[CONTROL_REQUEST_MAX];
+	int len;
+	GString *reply;
+	gsize sent;
+} diskd_client_t;
+
+/* quoted string, valid as a Prometheus label value and in JSON */
+static void diskd_append_quoted(GString *out, const char *str)
+{
+	g_string_append_c(out, '"');
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\') {
+			g_string_append_c(out, '\\');
+			g_string_append_c(out, *str);
+		} else if (*str == '\n') {
+			g_string_append(out, "\\n");
+		} else if ((unsigned char)*str < 0x20) {
+			g_string_append_c(out, '?');
+		} else {
+			g_string_append_c(out, *str);
+		}
+	}
+	g_string_append_c(out, '"');
+}
+
+static const char *diskd_target_value(diskd_target_t *target)
+{
+	const char *value;
+
+	diskd_status_lock();
+	value = target->value;
+	diskd_status_unlock();
+	return (value)? value : "unknown";
+}
+
+static void diskd_metric_labels(GString *out, diskd_target_t *target)
+{
+	g_string_append(out, "{target=");
+	diskd_append_quoted(out, target->name);
+	g_string_append(out, ",path=");
+	diskd_append_quoted(out, (target->wfile)? target->wdir : target->device);
+}
+
+static void diskd_metrics_counter(GString *out, const char *metric, const char *help, size_t offset)
+{
+	GList *gIter;
+
+	g_string_append_printf(out, "# HELP %s %s\n# TYPE %s counter\n", metric, help, metric);
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		g_string_append(out, metric);
+		diskd_metric_labels(out, target);
+		g_string_append_printf(out, "} %llu\n",
+			(unsigned long long)*(guint64 *)((char *)target + offset));
+	}
+}
+
+static void diskd_metrics_prometheus(GString *out)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99 };
+	GList *gIter;
+	int phase;
+	int i;
+
+	g_string_append(out, "# HELP diskd_status Current status of the target\n"
+		"# TYPE diskd_status gauge\n");
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		g_string_append(out, "diskd_status");
+		diskd_metric_labels(out, target);
+		g_string_append(out, ",status=");
+		diskd_append_quoted(out, diskd_target_value(target));
+		g_string_append(out, "} 1\n");
+	}
+	g_string_append(out, "# HELP diskd_last_check_timestamp_seconds Time the last check ended\n"
+		"# TYPE diskd_last_check_timestamp_seconds gauge\n");
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		g_string_append(out, "diskd_last_check_timestamp_seconds");
+		diskd_metric_labels(out, target);
+		g_string_append_printf(out, "} %.3f\n", target->last_check / 1e6);
+	}
+	diskd_metrics_counter(out, "diskd_checks_total", "Checks ended",
+		G_STRUCT_OFFSET(diskd_target_t, checks));
+	diskd_metrics_counter(out, "diskd_check_errors_total", "Checks ended in ERROR",
+		G_STRUCT_OFFSET(diskd_target_t, errors));
+	diskd_metrics_counter(out, "diskd_check_slow_total", "Checks ended in SLOW",
+		G_STRUCT_OFFSET(diskd_target_t, slows));
+	diskd_metrics_counter(out, "diskd_check_retries_total", "Attempts retried after an error",
+		G_STRUCT_OFFSET(diskd_target_t, retries));
+
+	g_string_append(out, "# HELP diskd_latency_seconds Latency of each check phase\n"
+		"# TYPE diskd_latency_seconds summary\n");
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		for (phase = 0; phase < PHASE_MAX; phase++) {
+			diskd_hist_t *hist = &target->hist[phase];
+
+			if (hist->count == 0) {
+				continue;
+			}
+			for (i = 0; i < G_N_ELEMENTS(quantiles); i++) {
+				g_string_append(out, "diskd_latency_seconds");
+				diskd_metric_labels(out, target);
+				g_string_append_printf(out, ",phase=\"%s\",quantile=\"%g\"} %.6f\n",
+					phase_names[phase], quantiles[i],
+					diskd_hist_quantile(hist, quantiles[i]) / 1e6);
+			}
+			g_string_append(out, "diskd_latency_seconds_sum");
+			diskd_metric_labels(out, target);
+			g_string_append_printf(out, ",phase=\"%s\"} %.6f\n",
+				phase_names[phase], hist->sum / 1e6);
+			g_string_append(out, "diskd_latency_seconds_count");
+			diskd_metric_labels(out, target);
+			g_string_append_printf(out, ",phase=\"%s\"} %llu\n",
+				phase_names[phase], (unsigned long long)hist->count);
+		}
+	}
+}
+
+static void diskd_metrics_json(GString *out)
+{
+	GList *gIter;
+	int phase;
+
+	g_string_append(out, "{\"targets\":[");
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		g_string_append(out, (gIter == targets)? "\n{\"name\":" : ",\n{\"name\":");
+		diskd_append_quoted(out, target->name);
+		g_string_append(out, ",\"path\":");
+		diskd_append_quoted(out, (target->wfile)? target->wdir : target->device);
+		g_string_append(out, ",\"status\":");
+		diskd_append_quoted(out, diskd_target_value(target));
+		g_string_append_printf(out, ",\"last_check\":%.3f,\"interval_ms\":%d"
+			",\"checks\":%llu,\"errors\":%llu,\"slow\":%llu,\"retries\":%llu,\"latency_us\":{",
+			target->last_check / 1e6, target->cur_interval,
+			(unsigned long long)target->checks, (unsigned long long)target->errors,
+			(unsigned long long)target->slows, (unsigned long long)target->retries);
+		for (phase = 0; phase < PHASE_MAX; phase++) {
+			diskd_hist_t *hist = &target->hist[phase];
+
+			g_string_append_printf(out, "%s\"%s\":{\"count\":%llu,\"sum\":%lld"
+				",\"p50\":%lld,\"p90\":%lld,\"p99\":%lld,\"max\":%lld}",
+				(phase == 0)? "" : ",", phase_names[phase],
+				(unsigned long long)hist->count, (long long)hist->sum,
+				(long long)diskd_hist_quantile(hist, 0.50),
+				(long long)diskd_hist_quantile(hist, 0.90),
+				(long long)diskd_hist_quantile(hist, 0.99), (long long)hist->max);
+		}
+		g_string_append(out, "}}");
+	}
+	g_string_append(out, "\n]}\n");
+}
+
+static void diskd_client_free(diskd_client_t *client)
+{
+	close(client->fd);
+	if (client->reply) {
+		g_string_free(client->reply, TRUE);
+	}
+	free(client);
+}
+
+static gboolean diskd_client_write(GIOChannel *channel, GIOCondition condition, gpointer data)
+{
+	diskd_client_t *client = data;
+	ssize_t rc;
+
+	while (client->sent < client->reply->len) {
+		rc = send(client->fd, client->reply->str + client->sent,
+			client->reply->len - client->sent, MSG_NOSIGNAL);
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		} else if (rc < 0 && errno == EAGAIN) {
+			return TRUE;	/* wait until the client reads */
+		} else if (rc <= 0) {
+			break;
+		}
+		client->sent += rc;
+	}
+	diskd_client_free(client);
+	return FALSE;
+}
+
+static void diskd_mounts_rescan(void);
+
+static void diskd_control_command(diskd_client_t *client)
+{
+	const char *cmd = client->request;
+
+	client->reply = g_string_sized_new(4096);
+	if (*cmd == '\0' || strcmp(cmd, "metrics") == 0) {
+		diskd_metrics_prometheus(client->reply);
+	} else if (strcmp(cmd, "json") == 0) {
+		diskd_metrics_json(client->reply);
+	} else if (strcmp(cmd, "events") == 0) {
+		diskd_event_dump(client->reply);
+	} else if (strcmp(cmd, "rescan") == 0 && mountinfo_fd >= 0) {
+		diskd_mounts_rescan();
+		g_string_append(client->reply, "ok\n");
+	} else {
+		g_string_append_printf(client->reply, "unknown command: %s\n", cmd);
+	}
+}
+
+static gboolean diskd_client_read(GIOChannel *channel, GIOCondition condition, gpointer data)
+{
+	diskd_client_t *client = data;
+	GIOChannel *out;
+	ssize_t rc;
+	char *eol;
+
+	rc = read(client->fd, client->request + client->len,
+		sizeof(client->request) - 1 - client->len);
+	if (rc < 0 && (errno == EINTR || errno == EAGAIN)) {
+		return TRUE;
+	} else if (rc < 0) {
+		diskd_client_free(client);
+		return FALSE;
+	}
+	client->len += rc;
+	client->request[client->len] = '\0';
+	eol = strpbrk(client->request, "\r\n");
+	if (eol) {
+		*eol = '\0';
+	} else if (rc > 0 && client->len < sizeof(client->request) - 1) {
+		return TRUE;	/* wait for the rest of the line */
+	}
+
+	diskd_control_command(client);
+	out = g_io_channel_unix_new(client->fd);
+	g_io_add_watch(out, G_IO_OUT | G_IO_ERR | G_IO_HUP, diskd_client_write, client);
+	g_io_channel_unref(out);
+	return FALSE;
+}
+
+static gboolean diskd_control_accept(GIOChannel *channel, GIOCondition condition, gpointer data)
+{
+	diskd_client_t *client;
+	GIOChannel *in;
+	int fd;
+
+	fd = accept4(control_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EINTR && errno != EAGAIN) {
+			crm_perror(LOG_WARNING, "accept() on the control socket failed");
+		}
+		return TRUE;
+	}
+	client = calloc(1, sizeof(diskd_client_t));
+	if (client == NULL) {
+		close(fd);
+		return TRUE;
+	}
+	client->fd = fd;
+	in = g_io_channel_unix_new(fd);
+	g_io_add_watch(in, G_IO_IN | G_IO_ERR | G_IO_HUP, diskd_client_read, client);
+	g_io_channel_unref(in);
+	return TRUE;
+}
+
+static gboolean diskd_control_init(void)
+{
+	struct sockaddr_un addr;
+	GIOChannel *channel;
+	mode_t mask;
+
+	if (strlen(control_path) >= sizeof(addr.sun_path)) {
+		crm_err("Control socket path %s is too long", control_path);
+		return FALSE;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, control_path);
+
+	control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (control_fd < 0) {
+		crm_perror(LOG_ERR, "socket() for the control socket failed");
+		return FALSE;
+	}
+	unlink(control_path);	/* left behind by a previous run */
+	mask = umask(0177);	/* only root may connect */
+	if (bind(control_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+	    || listen(control_fd, CONTROL_BACKLOG) < 0) {
+		crm_perror(LOG_ERR, "Could not listen on %s", control_path);
+		umask(mask);
+		close(control_fd);
+		control_fd = -1;
+		return FALSE;
+	}
+	umask(mask);
+
+	channel = g_io_channel_unix_new(control_fd);
+	g_io_add_watch(channel, G_IO_IN, diskd_control_accept, NULL);
+	g_io_channel_unref(channel);
+	return TRUE;
+}
+
+static void diskd_control_end(void)
+{
+	if (control_fd >= 0) {
+		close(control_fd);
+		control_fd = -1;
+		unlink(control_path);
+	}
+}
+
+static void diskd_remove_wfile(diskd_probe_t *probe)
+{
+	gint64 start = g_get_monotonic_time();
+
+	if (-1 == remove((const char *)probe->target->wfile)) {
+		crm_warn("failed to remove file %s", probe->target->wfile);
+	}
+	diskd_probe_record(probe, PHASE_REMOVE, start);
+}
+
+static int diskcheck_wt(diskd_probe_t *probe)
+{
+	diskd_target_t *target = probe->target;
+	int fd = -1;
+	int err;
+	int select_err;
+	struct timeval timeout_tv;
+	fd_set write_fd_set;
+	gint64 start;
+
+	crm_trace("diskcheck_wt start");
+
+	/* file open */
+	start = g_get_monotonic_time();
+	fd = open(target->wfile, O_WRONLY | O_CREAT | O_DSYNC | O_NONBLOCK, 0);
+	diskd_probe_record(probe, PHASE_OPEN, start);
+	if (fd == -1) {
+		crm_err("Could not open %s", target->wfile);
+		crm_perror(LOG_ERR, "%s", target->wfile);
+		return ERROR;  /* failed to open file. retried by the caller */
+	}
+
+	while( 1 ) {
+		start = g_get_monotonic_time();
+		err = write(fd, target->buf, WRITE_DATA);  /* data write */
+		diskd_probe_record(probe, PHASE_WRITE, start);
+		if (err == WRITE_DATA) {
+			crm_trace("data writing is OK");
+			close(fd);
+			diskd_remove_wfile(probe);
+			return normal;  /* OK */
+		} else if (err != WRITE_DATA && errno == EAGAIN) {
+			crm_warn("write function return errno:EAGAIN");
+			FD_ZERO(&write_fd_set);
+			FD_SET(fd, &write_fd_set);
+			timeout_tv.tv_sec = target->timeout / 1000;
+			timeout_tv.tv_usec = (target->timeout % 1000) * 1000;
+			select_err = select(fd+1, NULL, &write_fd_set, NULL, &timeout_tv);
+			if (select_err == 1) {
+				crm_warn("select ok, write again");
+				continue;  /* retly write */
+			} else if (select_err == -1) {
+				crm_err("select failed on file %s", target->wfile);
+				close(fd);
+				diskd_remove_wfile(probe);
+				break;  /* failed to select */
+			} else {
+				crm_err("select time out on file %s", target->wfile);
+				close(fd);
+				diskd_remove_wfile(probe);
+				break;  /* failed to select */
+			}
+		} else {
+			crm_err("Could not write to file %s", target->wfile);
+			crm_perror(LOG_ERR, "%s", target->wfile);
+			close(fd);
+			diskd_remove_wfile(probe);
+			break;  /* failed to write */
+		}
+	}
+
+	crm_warn("Error(s) occurred in diskcheck_wt function.");
+
+	return ERROR;
+}
+
+static guint64 diskd_random64(void)
+{
+	return ((guint64)g_random_int() << 32) | g_random_int();
+}
+
+/*
+ * Read target->samples pages spread over the device in one go.
+ * The device is divided into as many equal strata, the first page of the
+ * first one and a random page of each other one is read.  The reads are
+ * submitted together with the native AIO of Linux on the O_DIRECT fd, so
+ * the device serves them concurrently and the check takes about as long
+ * as a single read.
+ */
+static gboolean diskcheck_samples(diskd_probe_t *probe, int fd)
+{
+	diskd_target_t *target = probe->target;
+	struct iocb cbs[MAX_SAMPLES];
+	struct iocb *list[MAX_SAMPLES];
+	struct io_event events[MAX_SAMPLES];
+	aio_context_t ctx = 0;
+	guint64 size = 0;
+	guint64 stratum;
+	struct stat st;
+	gint64 start;
+	int submitted = 0;
+	int done = 0;
+	int err = 0;
+	int i;
+
+	if (ioctl(fd, BLKGETSIZE64, &size) != 0 && fstat(fd, &st) == 0) {
+		size = st.st_size;
+	}
+	stratum = size / pagesize / target->samples;
+	if (stratum == 0) {
+		crm_err("Device %s is too small for %d samples", target->device, target->samples);
+		return FALSE;
+	}
+
+	memset(cbs, 0, sizeof(cbs));
+	for (i = 0; i < target->samples; i++) {
+		guint64 page = (guint64)i * stratum;
+
+		if (i != 0) {
+			page += diskd_random64() % stratum;
+		}
+		cbs[i].aio_fildes = fd;
+		cbs[i].aio_lio_opcode = IOCB_CMD_PREAD;
+		cbs[i].aio_buf = (guint64)(gsize)((char *)target->buf + (gsize)i * pagesize);
+		cbs[i].aio_nbytes = pagesize;
+		cbs[i].aio_offset = (gint64)(page * pagesize);
+		cbs[i].aio_data = i;
+		list[i] = &cbs[i];
+	}
+
+	start = g_get_monotonic_time();
+	if (syscall(SYS_io_setup, target->samples, &ctx) < 0) {
+		err = errno;
+		crm_err("Could not set up AIO for device %s: %s", target->device, strerror(err));
+		goto out;
+	}
+	while (submitted < target->samples) {
+		long n = syscall(SYS_io_submit, ctx, target->samples - submitted, list + submitted);
+
+		if (n <= 0) {
+			err = (n < 0)? errno : EAGAIN;
+			crm_err("Could not submit %d read(s) to device %s: %s",
+				target->samples - submitted, target->device, strerror(err));
+			break;
+		}
+		submitted += n;
+	}
+	while (done < submitted) {
+		long n = syscall(SYS_io_getevents, ctx, 1, submitted - done, events, NULL);
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			crm_perror(LOG_ERR, "Could not wait for the reads of device %s", target->device);
+			if (err == 0) {
+				err = errno;
+			}
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			struct iocb *cb = &cbs[events[i].data];
+
+			if (events[i].res < 0) {
+				crm_err("Could not read from device %s at offset %lld: %s", target->device,
+					(long long)cb->aio_offset, strerror((int)-events[i].res));
+				if (err == 0) {
+					err = (int)-events[i].res;
+				}
+			} else if (events[i].res != pagesize) {
+				crm_err("Short read from device %s at offset %lld: %lld of %d bytes",
+					target->device, (long long)cb->aio_offset,
+					(long long)events[i].res, pagesize);
+				if (err == 0) {
+					err = EIO;
+				}
+			}
+		}
+		done += n;
+	}
+	syscall(SYS_io_destroy, ctx);
+out:
+	errno = err;
+	diskd_probe_record(probe, PHASE_READ, start);
+	return (err == 0);
+}
+
+static void diskd_close_wfd(diskd_target_t *target)
+{
+	if (target->wfd >= 0) {
+		close(target->wfd);
+		target->wfd = -1;
+	}
+}
+
+/*
+ * Keep the preallocated file of the target open.  It is only reopened
+ * when the path no longer refers to the same file, e.g. it was removed.
+ */
+static gboolean diskd_open_wfd(diskd_probe_t *probe)
+{
+	diskd_target_t *target = probe->target;
+	off_t size = (off_t)WRITE_SLOTS * pagesize;
+	struct stat st;
+	gint64 start = g_get_monotonic_time();
+	int err;
+
+	if (target->wfd >= 0) {
+		if (stat(target->wfile, &st) == 0
+		    && st.st_dev == target->wdev && st.st_ino == target->wino) {
+			return TRUE;
+		}
+		crm_info("%s was replaced, reopening it", target->wfile);
+		diskd_close_wfd(target);
+	}
+
+	target->wfd = open(target->wfile, O_RDWR | O_CREAT
+		| ((target->write_mode == WRITE_MODE_DIRECT)? O_DIRECT : 0), 0600);
+	diskd_probe_record(probe, PHASE_OPEN, start);
+	if (target->wfd == -1) {
+		crm_err("Could not open %s", target->wfile);
+		crm_perror(LOG_ERR, "%s", target->wfile);
+		return FALSE;
+	}
+	if (fstat(target->wfd, &st) != 0) {
+		crm_perror(LOG_ERR, "%s", target->wfile);
+		diskd_close_wfd(target);
+		return FALSE;
+	}
+	if (st.st_size < size) {
+		err = posix_fallocate(target->wfd, 0, size);
+		if (err != 0) {
+			crm_err("Could not preallocate %s: %s", target->wfile, strerror(err));
+			diskd_close_wfd(target);
+			return FALSE;
+		}
+	}
+	target->wdev = st.st_dev;
+	target->wino = st.st_ino;
+	return TRUE;
+}
+
+/*
+ * Fill the page with a pattern which changes on every write: a sequence
+ * number and a timestamp, then a xorshift stream seeded by them.  Arrays
+ * which detect zero or repeated pages must still write it to the media.
+ */
+static void diskd_fill_page(diskd_target_t *target)
+{
+	guint64 *word = target->buf;
+	guint64 x;
+	int i;
+
+	target->wseq++;
+	word[0] = GUINT64_TO_LE(target->wseq);
+	word[1] = GINT64_TO_LE(g_get_real_time());
+	x = (target->wseq * G_GUINT64_CONSTANT(0x9e3779b97f4a7c15)) ^ word[1] ^ 1;
+	for (i = 2; i < pagesize / (int)sizeof(guint64); i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		word[i] = x;
+	}
+}
+
+/*
+ * Write one page of the preallocated file and fdatasync() it.  Only data
+ * reaches the disk, no directory or inode update as with create/remove.
+ */
+static int diskcheck_prealloc(diskd_probe_t *probe)
+{
+	diskd_target_t *target = probe->target;
+	gint64 start;
+
+	crm_trace("diskcheck_prealloc start");
+
+	if (diskd_open_wfd(probe) == FALSE) {
+		return ERROR;
+	}
+
+	diskd_fill_page(target);
+	start = g_get_monotonic_time();
+	if (pwrite(target->wfd, target->buf, pagesize,
+		   (off_t)target->wslot * pagesize) != pagesize) {
+		diskd_probe_record(probe, PHASE_WRITE, start);
+		crm_err("Could not write to file %s", target->wfile);
+		crm_perror(LOG_ERR, "%s", target->wfile);
+		diskd_close_wfd(target);
+		return ERROR;
+	}
+	diskd_probe_record(probe, PHASE_WRITE, start);
+	target->wslot = (target->wslot + 1) % WRITE_SLOTS;
+
+	start = g_get_monotonic_time();
+	if (fdatasync(target->wfd) != 0) {
+		diskd_probe_record(probe, PHASE_SYNC, start);
+		crm_err("Could not sync file %s", target->wfile);
+		crm_perror(LOG_ERR, "%s", target->wfile);
+		diskd_close_wfd(target);
+		return ERROR;
+	}
+	diskd_probe_record(probe, PHASE_SYNC, start);
+	crm_trace("data writing is OK");
+	return normal;
+}
+
+static const char *sense_keys[] = {
+	"NO SENSE", "RECOVERED ERROR", "NOT READY", "MEDIUM ERROR",
+	"HARDWARE ERROR", "ILLEGAL REQUEST", "UNIT ATTENTION", "DATA PROTECT",
+	"BLANK CHECK", "VENDOR SPECIFIC", "COPY ABORTED", "ABORTED COMMAND",
+	"RESERVED", "VOLUME OVERFLOW", "MISCOMPARE", "COMPLETED",
+};
+
+/*
+ * Reason a SCSI command failed, NULL if it succeeded.  The sense key,
+ * ASC and ASCQ are returned for the log when there is sense data.
+ */
+static const char *diskd_sg_reason(sg_io_hdr_t *io, unsigned char *sense,
+	int *key, int *asc, int *ascq)
+{
+	*key = *asc = *ascq = -1;
+	if ((io->info & SG_INFO_OK_MASK) == SG_INFO_OK) {
+		return NULL;
+	}
+	if (io->sb_len_wr > 0) {
+		if ((sense[0] & 0x7f) >= 0x72) {	/* descriptor format */
+			*key = sense[1] & 0x0f;
+			*asc = sense[2];
+			*ascq = sense[3];
+		} else if (io->sb_len_wr >= 14) {	/* fixed format */
+			*key = sense[2] & 0x0f;
+			*asc = sense[12];
+			*ascq = sense[13];
+		}
+	}
+	if (*key == 0x01) {
+		return NULL;	/* the device has recovered by itself */
+	} else if (*key >= 0) {
+		return sense_keys[*key];
+	} else if (io->host_status == SCSI_DID_TIME_OUT) {
+		return "COMMAND TIMEOUT";
+	} else if (io->host_status != 0) {
+		return "TRANSPORT ERROR";
+	} else if (io->status == SCSI_STAT_BUSY) {
+		return "BUSY";
+	} else if (io->status == SCSI_STAT_RESERVATION_CONFLICT) {
+		return "RESERVATION CONFLICT";
+	} else if (io->status == SCSI_STAT_TASK_SET_FULL) {
+		return "TASK SET FULL";
+	} else if (io->driver_status != 0) {
+		return "DRIVER ERROR";
+	}
+	return "CHECK CONDITION";
+}
+
+/*
+ * Send TEST UNIT READY or READ(16) of the first block straight to the
+ * device with SG_IO.  The command bypasses the page cache and the I/O
+ * scheduler, so it does not queue behind the I/O of the applications,
+ * and it has its own timeout.
+ */
+static int diskcheck_sg(diskd_probe_t *probe)
+{
+	diskd_target_t *target = probe->target;
+	unsigned char cdb[16];
+	unsigned char sense[SG_SENSE_LEN];
+	sg_io_hdr_t io;
+	const char *reason = NULL;
+	int key, asc, ascq;
+	int blksz = 512;
+	int fd;
+	int i;
+	gint64 start;
+
+	start = g_get_monotonic_time();
+	fd = open((const char *)target->device, O_RDONLY | O_NONBLOCK);
+	diskd_probe_record(probe, PHASE_OPEN, start);
+	if (fd == -1) {
+		crm_err("Could not open device %s", target->device);
+		crm_perror(LOG_ERR, "%s", target->device);
+		return ERROR;
+	}
+	if (target->scsi == SCSI_PROBE_READ
+	    && (ioctl(fd, BLKSSZGET, &blksz) < 0 || blksz > pagesize)) {
+		crm_err("Could not get a usable block size of %s", target->device);
+		close(fd);
+		return ERROR;
+	}
+
+	/* a unit attention only reports an event such as a reset, send again once */
+	for (i = 0; i < 2; i++) {
+		memset(cdb, 0, sizeof(cdb));
+		memset(&io, 0, sizeof(io));
+		io.interface_id = 'S';
+		io.cmdp = cdb;
+		io.sbp = sense;
+		io.mx_sb_len = sizeof(sense);
+		io.timeout = target->timeout;
+		if (target->scsi == SCSI_PROBE_READ) {
+			cdb[0] = 0x88;		/* READ(16) of LBA 0 */
+			cdb[13] = 1;		/* one block */
+			io.cmd_len = 16;
+			io.dxfer_direction = SG_DXFER_FROM_DEV;
+			io.dxferp = target->buf;
+			io.dxfer_len = blksz;
+		} else {
+			cdb[0] = 0x00;		/* TEST UNIT READY */
+			io.cmd_len = 6;
+			io.dxfer_direction = SG_DXFER_NONE;
+		}
+
+		start = g_get_monotonic_time();
+		if (ioctl(fd, SG_IO, &io) < 0) {
+			diskd_probe_record(probe, PHASE_READ, start);
+			crm_perror(LOG_ERR, "SG_IO on %s failed", target->device);
+			close(fd);
+			probe->reason = "SG_IO FAILED";
+			return ERROR;
+		}
+		diskd_probe_record(probe, PHASE_READ, start);
+		reason = diskd_sg_reason(&io, sense, &key, &asc, &ascq);
+		if (key != 0x06) {
+			break;
+		}
+	}
+	close(fd);
+
+	if (reason == NULL) {
+		crm_trace("SCSI check of %s is OK", target->device);
+		return normal;
+	}
+	probe->reason = reason;
+	if (key >= 0) {
+		crm_err("SCSI check of %s failed: %s, ASC/ASCQ 0x%02x/0x%02x",
+			target->device, reason, asc, ascq);
+	} else {
+		crm_err("SCSI check of %s failed: %s (status 0x%x, host 0x%x, driver 0x%x)",
+			target->device, reason, io.status, io.host_status, io.driver_status);
+	}
+	return ERROR;
+}
+
+/*
+ * Peer slots.  Every node owns a PEER_SLOT_SIZE slot in a reserved area
+ * of the shared device, like the slots of sbd.  A check writes the next
+ * sequence number to our slot and reads the whole area back in one I/O,
+ * so one probe shows which peers still reach the device.
+ */
+static int diskcheck_peers(diskd_probe_t *probe)
+{
+	diskd_target_t *target = probe->target;
+	diskd_peer_slot_t *slot = target->buf;
+	size_t area = (size_t)target->peer_slots * PEER_SLOT_SIZE;
+	struct utsname name;
+	ssize_t rc;
+	int fd;
+	gint64 start;
+
+	memset(target->buf, 0, PEER_SLOT_SIZE);
+	memcpy(slot->magic, PEER_MAGIC, sizeof(slot->magic));
+	slot->seq = GUINT64_TO_LE(++target->peer_seq);
+	slot->time = GINT64_TO_LE(g_get_real_time());
+	slot->seen = GUINT64_TO_LE(target->peer_seen);
+	if (uname(&name) == 0) {
+		g_strlcpy(slot->node, name.nodename, sizeof(slot->node));
+	}
+
+	start = g_get_monotonic_time();
+	fd = open((const char *)target->device, O_RDWR | O_DIRECT | O_DSYNC);
+	diskd_probe_record(probe, PHASE_OPEN, start);
+	if (fd == -1) {
+		crm_err("Could not open device %s", target->device);
+		crm_perror(LOG_ERR, "%s", target->device);
+		return ERROR;
+	}
+
+	start = g_get_monotonic_time();
+	rc = pwrite(fd, target->buf, PEER_SLOT_SIZE,
+		target->peer_offset + (off_t)target->peer_slot * PEER_SLOT_SIZE);
+	diskd_probe_record(probe, PHASE_WRITE, start);
+	if (rc != PEER_SLOT_SIZE) {
+		crm_err("Could not write slot %d of %s", target->peer_slot, target->device);
+		crm_perror(LOG_ERR, "%s", target->device);
+		close(fd);
+		return ERROR;
+	}
+
+	start = g_get_monotonic_time();
+	rc = pread(fd, target->buf, area, target->peer_offset);
+	diskd_probe_record(probe, PHASE_READ, start);
+	close(fd);
+	if (rc != area) {
+		crm_err("Could not read the slots of %s", target->device);
+		crm_perror(LOG_ERR, "%s", target->device);
+		return ERROR;
+	}
+	return normal;
+}
+
+static int diskcheck(diskd_probe_t *probe)
+{
+	diskd_target_t *target = probe->target;
+	/* the native AIO of the sampled reads is only asynchronous with O_DIRECT */
+	gboolean direct = (target->direct || target->samples > 1);
+	int fd = -1;
+	int err;
+	int select_err;
+	struct timeval timeout_tv;
+	fd_set read_fd_set;
+	gint64 start;
+
+	crm_trace("diskcheck start");
+
+	start = g_get_monotonic_time();
+	fd = open((const char *)target->device,
+		O_RDONLY | O_NONBLOCK | ((direct)? O_DIRECT : 0), 0);
+	diskd_probe_record(probe, PHASE_OPEN, start);
+	if (fd == -1) {
+		crm_err("Could not open device %s", target->device);
+		crm_perror(LOG_ERR, "%s", target->device);
+		return ERROR;
+	}
+
+	/*
+	 * O_DIRECT reads the media through the page aligned buffer,
+	 * without evicting the buffer cache of the whole device.
+	 */
+	if (direct == FALSE) {
+		start = g_get_monotonic_time();
+		err = ioctl(fd, BLKFLSBUF, 0);
+		diskd_probe_record(probe, PHASE_FLUSH, start);
+		if (err != 0) {
+			crm_err("ioctl error, Could not flush buffer");
+			close(fd);
+			return ERROR;
+		}
+	}
+
+	if (target->samples > 1) {
+		err = diskcheck_samples(probe, fd);
+		close(fd);
+		if (err) {
+			crm_trace("reading form data is OK");
+			return normal;
+		}
+		return ERROR;
+	}
+
+	while( 1 ) {
+		start = g_get_monotonic_time();
+		err = read(fd, target->buf, pagesize);
+		diskd_probe_record(probe, PHASE_READ, start);
+		if (err == pagesize) {
+			crm_trace("reading form data is OK");
+			close(fd);
+			return normal;
+		} else if (err != pagesize && errno == EAGAIN) {
+			crm_warn("read function return errno:EAGAIN");
+			FD_ZERO(&read_fd_set);
+			FD_SET(fd, &read_fd_set);
+			timeout_tv.tv_sec = target->timeout / 1000;
+			timeout_tv.tv_usec = (target->timeout % 1000) * 1000;
+			select_err = select(fd+1, &read_fd_set, NULL, NULL, &timeout_tv);
+			if (select_err == 1) {
+				crm_warn("select ok, read again");
+				continue;
+			} else if (select_err == -1) {
+				crm_err("select failed on device %s", target->device);
+				close(fd);
+				break;
+			}
+		} else {
+			crm_err("Could not read from device %s", target->device);
+			close(fd);
+			break;
+		}
+	}
+	crm_warn("Error(s) occurred in diskcheck function.");
+
+	return ERROR;
+}
+
+static gboolean
+parse_int_range(const char *value, int min, int max, int *result)
+{
+	char *end = NULL;
+	long v;
+
+	if (value == NULL || *value == '\0') {
+		return FALSE;
+	}
+	errno = 0;
+	v = strtol(value, &end, 10);
+	if (errno != 0 || *end != '\0' || v < min || v > max) {
+		return FALSE;
+	}
+	*result = (int)v;
+	return TRUE;
+}
+
+/*
+ * Parse a time into msec.  A bare number is in seconds as it always was,
+ * a unit may be given for finer values (e.g. "250ms").
+ */
+static gboolean
+parse_msec_range(const char *value, int min, int max, int *result)
+{
+	long long msec;
+
+	if (value == NULL || *value == '\0') {
+		return FALSE;
+	}
+	msec = crm_get_msec(value);
+	if (msec < min || msec > max) {
+		return FALSE;
+	}
+	*result = (int)msec;
+	return TRUE;
+}
+
+static gboolean
+parse_offset(const char *value, gint64 *result)
+{
+	char *end = NULL;
+	long long v;
+
+	if (value == NULL || *value == '\0') {
+		return FALSE;
+	}
+	errno = 0;
+	v = strtoll(value, &end, 0);
+	if (errno != 0 || *end != '\0' || v < 0) {
+		return FALSE;
+	}
+	*result = v;
+	return TRUE;
+}
+
+/* "rt[:<level>]", "be[:<level>]", "idle" or "none" */
+static gboolean
+parse_ioprio(const char *value, int *result)
+{
+	const char *level;
+	int class;
+	int data = 4;	/* the default level of the kernel */
+
+	if (value == NULL) {
+		return FALSE;
+	}
+	level = strchr(value, ':');
+	if (strncmp(value, "rt", 2) == 0 && (value[2] == ':' || value[2] == '\0')) {
+		class = IOPRIO_CLASS_RT;
+	} else if (strncmp(value, "be", 2) == 0 && (value[2] == ':' || value[2] == '\0')) {
+		class = IOPRIO_CLASS_BE;
+	} else if (strcmp(value, "idle") == 0) {
+		class = IOPRIO_CLASS_IDLE;
+		data = 0;
+	} else if (strcmp(value, "none") == 0) {
+		*result = -1;
+		return TRUE;
+	} else {
+		crm_err("Invalid I/O priority \"%s\"", value);
+		return FALSE;
+	}
+	if (level && parse_int_range(level + 1, 0, IOPRIO_LEVELS - 1, &data) == FALSE) {
+		return FALSE;
+	}
+	*result = IOPRIO_PRIO_VALUE(class, data);
+	return TRUE;
+}
+
+/* "0,2-3", the CPUs the probe and watchdog threads may run on */
+static gboolean
+parse_cpus(const char *value, cpu_set_t *cpus)
+{
+	gchar **items = g_strsplit(value, ",", 0);
+	cpu_set_t allowed;
+	gboolean rc = TRUE;
+	int i;
+
+	CPU_ZERO(cpus);
+	for (i = 0; items[i] != NULL && rc; i++) {
+		int first, last;
+		char c;
+
+		if (sscanf(items[i], "%d-%d%c", &first, &last, &c) != 2) {
+			if (sscanf(items[i], "%d%c", &first, &c) != 1) {
+				rc = FALSE;
+				break;
+			}
+			last = first;
+		}
+		if (first < 0 || first > last || last >= CPU_SETSIZE) {
+			rc = FALSE;
+			break;
+		}
+		for (; first <= last; first++) {
+			CPU_SET(first, cpus);
+		}
+	}
+	g_strfreev(items);
+	if (rc && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+		CPU_AND(&allowed, &allowed, cpus);
+		if (CPU_COUNT(&allowed) == 0) {
+			crm_err("None of the CPUs \"%s\" is available", value);
+			return FALSE;
+		}
+	}
+	if (rc == FALSE) {
+		crm_err("Invalid CPU list \"%s\"", value);
+	}
+	return rc;
+}
+
+/* "<n>/<m>", n of the last m checks */
+static gboolean
+parse_hysteresis(const char *value, int *count, int *window)
+{
+	int n, m;
+	char c;
+
+	if (value == NULL || sscanf(value, "%d/%d%c", &n, &m, &c) != 2
+	    || n < 1 || n > m || m > MAX_HYSTERESIS_WINDOW) {
+		crm_err("Invalid value \"%s\", expected <n>/<m> with 1 <= n <= m <= %d",
+			(value)? value : "", MAX_HYSTERESIS_WINDOW);
+		return FALSE;
+	}
+	*count = n;
+	*window = m;
+	return TRUE;
+}
+
+static gboolean
+parse_write_mode(const char *value, int *result)
+{
+	if (value == NULL) {
+		return FALSE;
+	} else if (strcmp(value, "create") == 0) {
+		*result = WRITE_MODE_CREATE;
+	} else if (strcmp(value, "prealloc") == 0) {
+		*result = WRITE_MODE_PREALLOC;
+	} else if (strcmp(value, "direct") == 0) {
+		*result = WRITE_MODE_DIRECT;
+	} else {
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static gboolean
+parse_scsi_probe(const char *value, int *result)
+{
+	if (value == NULL) {
+		return FALSE;
+	} else if (strcmp(value, "tur") == 0) {
+		*result = SCSI_PROBE_TUR;
+	} else if (strcmp(value, "read16") == 0) {
+		*result = SCSI_PROBE_READ;
+	} else {
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static diskd_target_t *
+target_new(void)
+{
+	diskd_target_t *target = calloc(1, sizeof(diskd_target_t));
+
+	if (target == NULL) {
+		crm_err("Could not allocate memory");
+		crm_exit(1);
+	}
+	target->name = strdup(diskd_attr);
+	target->interval = interval;
+	target->fast_interval = fast_interval;
+	target->max_interval = max_interval;
+	target->timeout = timeout;
+	target->retry = retry;
+	target->retry_interval = retry_interval;
+	target->retry_backoff = retry_backoff;
+	target->retry_jitter = retry_jitter;
+	target->jitter = check_jitter;
+	target->slow_threshold = slow_threshold;
+	target->slow_window = slow_window;
+	target->slow_percentile = 99;
+	target->fail_count = fail_count;
+	target->fail_window = fail_window;
+	target->recover_count = recover_count;
+	target->recover_window = recover_window;
+	target->direct = direct_read;
+	target->samples = samples;
+	target->scsi = scsi_probe;
+	target->ioprio = io_priority;
+	target->check_paths = check_paths;
+	target->write_mode = write_mode;
+	target->wfd = -1;
+	target->heap_index = -1;
+	target->peer_offset = -1;
+	return target;
+}
+
+static void
+target_set_write_dir(diskd_target_t *target, const char *dir)
+{
+	free(target->wdir);
+	free(target->wfile);
+	target->wdir = strdup(dir);
+	target->wfile = calloc(1, PATH_MAX);
+	g_snprintf(target->wfile, PATH_MAX, "%s/%s", dir, WRITE_FILE);
+}
+
+static void
+target_free(gpointer data)
+{
+	diskd_target_t *target = data;
+
+	free(target->name);
+	free(target->spec);
+	free(target->device);
+	free(target->wdir);
+	free(target->wfile);
+	diskd_close_wfd(target);
+	free(target->ptr);
+	free(target->window);
+	free(target->paths_attr);
+	free(target->mount_state);
+	if (target->peers) {
+		int i;
+
+		for (i = 0; i < target->peer_slots; i++) {
+			free(target->peers[i].attr);
+			free(target->peers[i].sees_attr);
+		}
+		free(target->peers);
+	}
+	free(target->peers_attr);
+	g_list_free(target->paths);
+	free(target);
+}
+
+static diskd_target_t *diskd_find_target(GList *list, const char *name)
+{
+	GList *gIter;
+
+	for (gIter = list; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		if (strcmp(target->name, name) == 0) {
+			return target;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Parse a target specification given with -T,
+ * e.g. "device=/dev/sdb,name=diskd_sdb,interval=10".
+ * Keys which are not given take the value of the global options.
+ */
+static diskd_target_t *
+target_parse(const char *spec)
+{
+	diskd_target_t *target = target_new();
+	gchar **items = g_strsplit(spec, ",", 0);
+	int i;
+	int err = 0;
+
+	for (i = 0; items[i] != NULL; i++) {
+		char *key = items[i];
+		char *value = strchr(key, '=');
+
+		if (*key == '\0') {
+			continue;
+		}
+		if (value != NULL) {
+			*value++ = '\0';
+		}
+
+		if (strcmp(key, "device") == 0 && value != NULL && *value != '\0') {
+			free(target->device);
+			target->device = strdup(value);
+		} else if (strcmp(key, "write-dir") == 0) {
+			target_set_write_dir(target, (value && *value)? value : WRITE_DIR);
+		} else if (strcmp(key, "name") == 0 && value != NULL && *value != '\0') {
+			free(target->name);
+			target->name = strdup(value);
+		} else if (strcmp(key, "interval") == 0) {
+			err += !parse_msec_range(value, MIN_INTERVAL, MAX_INTERVAL, &target->interval);
+		} else if (strcmp(key, "fast-interval") == 0) {
+			err += !parse_msec_range(value, MIN_INTERVAL, MAX_INTERVAL, &target->fast_interval);
+		} else if (strcmp(key, "max-interval") == 0) {
+			err += !parse_msec_range(value, MIN_INTERVAL, MAX_INTERVAL, &target->max_interval);
+		} else if (strcmp(key, "timeout") == 0) {
+			err += !parse_msec_range(value, MIN_TIMEOUT, MAX_TIMEOUT, &target->timeout);
+		} else if (strcmp(key, "retry") == 0) {
+			err += !parse_int_range(value, MIN_RETRY, MAX_RETRY, &target->retry);
+		} else if (strcmp(key, "retry-interval") == 0) {
+			err += !parse_msec_range(value, MIN_RETRY_INTERVAL, MAX_RETRY_INTERVAL,
+				&target->retry_interval);
+		} else if (strcmp(key, "retry-backoff") == 0) {
+			err += !parse_int_range(value, MIN_RETRY_BACKOFF, MAX_RETRY_BACKOFF,
+				&target->retry_backoff);
+		} else if (strcmp(key, "retry-jitter") == 0) {
+			err += !parse_int_range(value, MIN_RETRY_JITTER, MAX_RETRY_JITTER,
+				&target->retry_jitter);
+		} else if (strcmp(key, "jitter") == 0) {
+			err += !parse_int_range(value, MIN_JITTER, MAX_JITTER, &target->jitter);
+		} else if (strcmp(key, "slow-threshold") == 0) {
+			err += !parse_msec_range(value, MIN_SLOW_THRESHOLD, MAX_SLOW_THRESHOLD,
+				&target->slow_threshold);
+		} else if (strcmp(key, "slow-window") == 0) {
+			err += !parse_int_range(value, MIN_SLOW_WINDOW, MAX_SLOW_WINDOW, &target->slow_window);
+		} else if (strcmp(key, "slow-percentile") == 0) {
+			err += !parse_int_range(value, 1, 100, &target->slow_percentile);
+		} else if (strcmp(key, "fail-window") == 0) {
+			err += !parse_hysteresis(value, &target->fail_count, &target->fail_window);
+		} else if (strcmp(key, "recover-window") == 0) {
+			err += !parse_hysteresis(value, &target->recover_count, &target->recover_window);
+		} else if (strcmp(key, "ioprio") == 0) {
+			err += !parse_ioprio(value, &target->ioprio);
+		} else if (strcmp(key, "samples") == 0) {
+			err += !parse_int_range(value, MIN_SAMPLES, MAX_SAMPLES, &target->samples);
+		} else if (strcmp(key, "write-mode") == 0) {
+			err += !parse_write_mode(value, &target->write_mode);
+		} else if (strcmp(key, "peer-offset") == 0) {
+			err += !parse_offset(value, &target->peer_offset);
+		} else if (strcmp(key, "peer-slots") == 0) {
+			err += !parse_int_range(value, 1, MAX_PEER_SLOTS, &target->peer_slots);
+		} else if (strcmp(key, "peer-slot") == 0) {
+			err += !parse_int_range(value, 0, MAX_PEER_SLOTS - 1, &target->peer_slot);
+		} else if (strcmp(key, "peer-timeout") == 0) {
+			err += !parse_msec_range(value, MIN_TIMEOUT, MAX_INTERVAL, &target->peer_timeout);
+		} else if (strcmp(key, "paths") == 0 && value != NULL) {
+			target->check_paths = crm_is_true(value);
+			target->paths_given = target->check_paths;
+		} else if (strcmp(key, "read-mode") == 0 && value != NULL) {
+			if (strcmp(value, "direct") == 0) {
+				target->direct = TRUE;
+				target->scsi = SCSI_PROBE_NONE;
+			} else if (strcmp(value, "flush") == 0) {
+				target->direct = FALSE;
+				target->scsi = SCSI_PROBE_NONE;
+			} else {
+				err += !parse_scsi_probe(value, &target->scsi);
+			}
+		} else {
+			crm_err("Invalid key \"%s\" in target \"%s\"", key, spec);
+			err++;
+		}
+	}
+	g_strfreev(items);
+
+	if ((target->device == NULL) == (target->wfile == NULL)) {
+		crm_err("Target \"%s\" needs exactly one of device or write-dir", spec);
+		err++;
+	}
+	if (err) {
+		crm_err("Invalid target \"%s\"", spec);
+		target_free(target);
+		return NULL;
+	}
+	return target;
+}
+
+/*
+ * Collect the devices at the bottom of the stack under a device mapper
+ * device, e.g. the SCSI paths of a multipath map, also below partitions
+ * mapped by kpartx.
+ */
+static void diskd_find_paths(const char *sysdir, GList **paths)
+{
+	char slaves[PATH_MAX];
+	struct dirent *ent;
+	DIR *dir;
+
+	g_snprintf(slaves, sizeof(slaves), "%s/slaves", sysdir);
+	dir = opendir(slaves);
+	if (dir == NULL) {
+		return;
+	}
+	while ((ent = readdir(dir)) != NULL) {
+		char sub[PATH_MAX];
+		GList *below = NULL;
+
+		if (ent->d_name[0] == '.') {
+			continue;
+		}
+		g_snprintf(sub, sizeof(sub), "/sys/block/%s", ent->d_name);
+		diskd_find_paths(sub, &below);
+		if (below) {
+			*paths = g_list_concat(*paths, below);
+		} else {
+			*paths = g_list_append(*paths, strdup(ent->d_name));
+		}
+	}
+	closedir(dir);
+}
+
+static diskd_target_t *
+target_new_path(diskd_target_t *parent, const char *slave)
+{
+	diskd_target_t *target = target_new();
+	char buf[PATH_MAX];
+	char *p;
+
+	free(target->name);
+	g_snprintf(buf, sizeof(buf), "%s_%s", parent->name, slave);
+	target->name = strdup(buf);
+	g_snprintf(buf, sizeof(buf), "%s,path=%s", parent->spec, slave);
+	target->spec = strdup(buf);
+	g_snprintf(buf, sizeof(buf), "/dev/%s", slave);
+	for (p = buf; *p != '\0'; p++) {
+		if (*p == '!') {	/* sysfs name of e.g. cciss/c0d0 */
+			*p = '/';
+		}
+	}
+	target->device = strdup(buf);
+	target->parent = parent;
+	target->interval = parent->interval;
+	target->fast_interval = parent->fast_interval;
+	target->max_interval = parent->max_interval;
+	target->timeout = parent->timeout;
+	target->retry = parent->retry;
+	target->retry_interval = parent->retry_interval;
+	target->retry_backoff = parent->retry_backoff;
+	target->retry_jitter = parent->retry_jitter;
+	target->jitter = parent->jitter;
+	target->slow_threshold = parent->slow_threshold;
+	target->slow_window = parent->slow_window;
+	target->slow_percentile = parent->slow_percentile;
+	target->fail_count = parent->fail_count;
+	target->fail_window = parent->fail_window;
+	target->recover_count = parent->recover_count;
+	target->recover_window = parent->recover_window;
+	target->direct = parent->direct;
+	target->samples = parent->samples;
+	target->scsi = parent->scsi;
+	target->ioprio = parent->ioprio;
+	return target;
+}
+
+/*
+ * Add a target for every path of the multipath devices which ask for it.
+ * The paths are checked on their own, and "<name>_paths" counts the
+ * healthy ones, so a degraded fabric shows before the map fails.
+ */
+static gboolean diskd_expand_paths(GList **list)
+{
+	GList *gIter;
+	GList *added = NULL;
+	int err = 0;
+
+	for (gIter = *list; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+		GList *paths = NULL;
+		GList *pIter;
+		struct stat st;
+		char sysdir[PATH_MAX];
+		char buf[PATH_MAX];
+
+		if (target->check_paths == FALSE || target->device == NULL
+		    || target->peer_slots > 0) {
+			continue;
+		}
+		if (stat(target->device, &st) == 0 && S_ISBLK(st.st_mode)) {
+			g_snprintf(sysdir, sizeof(sysdir), "/sys/dev/block/%u:%u",
+				major(st.st_rdev), minor(st.st_rdev));
+			diskd_find_paths(sysdir, &paths);
+		}
+		if (paths == NULL) {
+			/*
+			 * Not a device mapper device, e.g. a disk or a partition
+			 * under the global -P: the device itself is checked.
+			 */
+			if (target->paths_given) {
+				crm_err("No path is found under %s", target->device);
+				err++;
+			} else {
+				crm_info("%s has no paths, it is checked as it is", target->device);
+			}
+			continue;
+		}
+		g_snprintf(buf, sizeof(buf), "%s_paths", target->name);
+		target->paths_attr = strdup(buf);
+		for (pIter = paths; pIter != NULL; pIter = pIter->next) {
+			diskd_target_t *path = target_new_path(target, pIter->data);
+
+			crm_info("Checking %s as a path of %s", path->device, target->device);
+			target->paths = g_list_append(target->paths, path);
+			added = g_list_append(added, path);
+		}
+		g_list_free_full(paths, free);
+	}
+	*list = g_list_concat(*list, added);
+	return (err == 0);
+}
+
+/* the same node and target always get the same phase */
+static guint
+diskd_phase_hash(diskd_target_t *target)
+{
+	struct utsname name;
+	char *key;
+	guint hash;
+
+	if (uname(&name) < 0) {
+		name.nodename[0] = '\0';
+	}
+	key = g_strdup_printf("%s/%s", name.nodename, target->name);
+	hash = g_str_hash(key);
+	g_free(key);
+	return hash;
+}
+
+/* complete the parameters which depend on each other */
+static gboolean
+target_check(diskd_target_t *target)
+{
+	if (target->fast_interval == 0) {
+		target->fast_interval = target->interval;
+	}
+	if (target->max_interval == 0) {
+		target->max_interval = target->interval;
+	}
+	if (target->fast_interval > target->interval || target->max_interval < target->interval) {
+		crm_err("Target %s needs fast-interval <= interval <= max-interval", target->name);
+		return FALSE;
+	}
+	target->cur_interval = target->interval;
+	target->phase_hash = diskd_phase_hash(target);
+	if (target->ioprio >= 0) {
+		ioprio_used = TRUE;
+	}
+
+	if (target->peer_slots > 0) {
+		/* no default offset, a wrong one would overwrite data */
+		if (target->device == NULL || target->peer_slot >= target->peer_slots
+		    || target->peer_offset < 0 || target->peer_offset % PEER_SLOT_SIZE != 0) {
+			crm_err("Target %s needs a device, peer-slot < peer-slots and"
+				" peer-offset aligned to %d", target->name, PEER_SLOT_SIZE);
+			return FALSE;
+		}
+		if (target->peer_timeout == 0) {
+			target->peer_timeout = 3 * target->max_interval;
+		}
+	}
+	return TRUE;
+}
+
+static gboolean
+target_alloc_buffer(diskd_target_t *target)
+{
+	if (target->wfile) {	/* writer, a page for O_DIRECT in WRITE_MODE_DIRECT */
+		target->ptr = (void *)calloc(2, pagesize);
+	} else if (target->peer_slots > 0) {	/* the whole peer area */
+		char buf[PATH_MAX];
+
+		target->ptr = (void *)malloc(target->peer_slots * PEER_SLOT_SIZE + pagesize);
+		target->peers = calloc(target->peer_slots, sizeof(diskd_peer_t));
+		g_snprintf(buf, sizeof(buf), "%s_peers", target->name);
+		target->peers_attr = strdup(buf);
+		if (target->peers == NULL) {
+			crm_err("Could not allocate memory");
+			return FALSE;
+		}
+	} else {	/* reader */
+		target->ptr = (void *)malloc((target->samples + 1) * pagesize);
+	}
+	target->buf = (void *)(((u_long)target->ptr + pagesize) & ~(pagesize-1));
+	if (target->slow_threshold > 0) {
+		target->window = calloc(target->slow_window, sizeof(gint64));
+	}
+	if (target->ptr == NULL || (target->slow_threshold > 0 && target->window == NULL)) {
+		crm_err("Could not allocate memory");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Read the targets of the config file, one specification as given with
+ * -T per line.  Blank lines and lines starting with '#' are skipped.
+ */
+static gboolean diskd_read_config(GList **specs)
+{
+	char line[PATH_MAX * 2];
+	FILE *fp;
+
+	fp = fopen(config_path, "r");
+	if (fp == NULL) {
+		crm_perror(LOG_ERR, "Could not open %s", config_path);
+		return FALSE;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char *spec = g_strstrip(line);
+
+		if (*spec != '\0' && *spec != '#') {
+			*specs = g_list_append(*specs, strdup(spec));
+		}
+	}
+	fclose(fp);
+	return TRUE;
+}
+
+/*
+ * Build the targets of the options and of the config file, NULL if one of
+ * them is wrong.  Each target keeps the specification it was built from,
+ * so that a reload can tell whether it has changed.
+ */
+static GList *diskd_load_targets(void)
+{
+	GList *list = NULL;
+	GList *config = NULL;
+	GList *specs;
+	GList *gIter;
+	int err = 0;
+
+	if (device != NULL || wflag) {
+		diskd_target_t *target = target_new();
+		char buf[PATH_MAX];
+
+		if (device != NULL) {
+			target->device = strdup(device);
+			g_snprintf(buf, sizeof(buf), "device=%s", device);
+		} else {
+			target_set_write_dir(target, (wdir)? wdir : WRITE_DIR);
+			g_snprintf(buf, sizeof(buf), "write-dir=%s", target->wdir);
+		}
+		target->spec = strdup(buf);
+		list = g_list_append(list, target);
+	}
+	if (config_path && diskd_read_config(&config) == FALSE) {
+		err++;
+	}
+	specs = g_list_concat(g_list_copy(target_specs), g_list_copy(config));
+	for (gIter = specs; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = target_parse(gIter->data);
+
+		if (target == NULL) {
+			err++;
+		} else {
+			target->spec = strdup(gIter->data);
+			list = g_list_append(list, target);
+		}
+	}
+	g_list_free(specs);
+	g_list_free_full(config, free);
+	if (oneshot_flag == 0 && diskd_expand_paths(&list) == FALSE) {
+		err++;
+	}
+
+	for (gIter = list; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+		GList *gIter2;
+
+		if (target_check(target) == FALSE) {
+			err++;
+		}
+		for (gIter2 = gIter->next; gIter2 != NULL; gIter2 = gIter2->next) {
+			diskd_target_t *other = gIter2->data;
+
+			if (strcmp(target->name, other->name) == 0) {
+				crm_err("Attribute name %s is used by more than one target", target->name);
+				err++;
+			}
+		}
+	}
+	if (list == NULL) {
+		crm_err("No target to check");
+	}
+	if (err) {
+		g_list_free_full(list, target_free);
+		return NULL;
+	}
+	return list;
+}
+
+static int diskcheck_target(diskd_probe_t *probe)
+{
+	gint64 start = g_get_monotonic_time();
+	int rc;
+
+	if (probe->target->wfile && probe->target->write_mode != WRITE_MODE_CREATE) {
+		rc = diskcheck_prealloc(probe);
+	} else if (probe->target->wfile) {
+		rc = diskcheck_wt(probe);
+	} else if (probe->target->peer_slots > 0) {
+		rc = diskcheck_peers(probe);
+	} else if (probe->target->scsi != SCSI_PROBE_NONE) {
+		rc = diskcheck_sg(probe);
+	} else {
+		rc = diskcheck(probe);
+	}
+	diskd_probe_record(probe, PHASE_TOTAL, start);
+	return rc;
+}
+
+static int diskd_cmp_usec(const void *a, const void *b)
+{
+	gint64 x = *(const gint64 *)a;
+	gint64 y = *(const gint64 *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Add the latency of a good check to the window of the target and
+ * return SLOW if the percentile over the window exceeds the threshold.
+ */
+static int diskd_slow_check(diskd_target_t *target, gint64 usec)
+{
+	gint64 sorted[MAX_SLOW_WINDOW];
+	gint64 value;
+	int rank;
+
+	if (target->slow_threshold == 0 || target->window == NULL) {
+		return normal;
+	}
+
+	target->window[target->window_pos] = usec;
+	target->window_pos = (target->window_pos + 1) % target->slow_window;
+	if (target->window_count < target->slow_window) {
+		target->window_count++;
+	}
+
+	memcpy(sorted, target->window, target->window_count * sizeof(gint64));
+	qsort(sorted, target->window_count, sizeof(gint64), diskd_cmp_usec);
+	rank = (target->window_count * target->slow_percentile + 99) / 100;
+	value = sorted[MAX(rank, 1) - 1];
+
+	if (value > (gint64)target->slow_threshold * 1000) {
+		if (target->value == NULL || strcmp(target->value, "SLOW") != 0) {
+			crm_warn("disk is slow, attr_name=%s, p%d=%lldms over %d checks (threshold %dms)",
+				target->name, target->slow_percentile, (long long)(value / 1000),
+				target->window_count, target->slow_threshold);
+		}
+		return SLOW;
+	}
+	return normal;
+}
+
+/*
+ * The disk checks run in the probe pool, so that a slow or hung device
+ * blocks neither the main loop nor the checks of the other targets.
+ * Each target goes through a small state machine in the main loop:
+ *
+ *   IDLE --interval--> PROBING --error--> RETRY_WAIT --timer--> PROBING
+ *     ^                   |                                        |
+ *     +----good or no retry left, status reported-------------------+
+ */
+static gboolean diskd_attempt_start(diskd_target_t *target);
+
+/* msec to wait before the next attempt */
+static guint diskd_retry_delay(diskd_target_t *target)
+{
+	gint64 delay = target->retry_interval;
+	int i;
+
+	for (i = 1; i < target->attempt; i++) {
+		delay *= target->retry_backoff;
+		if (delay >= MAX_RETRY_INTERVAL) {
+			delay = MAX_RETRY_INTERVAL;
+			break;
+		}
+	}
+	if (target->retry_jitter > 0) {
+		delay += delay * g_random_int_range(-target->retry_jitter, target->retry_jitter + 1) / 100;
+	}
+	return (guint)delay;
+}
+
+static gboolean diskd_retry_timer(gpointer data)
+{
+	diskd_target_t *target = data;
+
+	target->retry_id = 0;
+	diskd_attempt_start(target);
+	return FALSE;
+}
+
+static gboolean diskd_check_start(gpointer data);
+
+/*
+ * Time since the current interval began, on a wall clock grid shifted by
+ * an offset hashed from the node and target names.  Daemons restarted at
+ * the same moment then spread their checks over the interval instead of
+ * all probing a shared array at once.
+ */
+static gint64 diskd_phase_lag(diskd_target_t *target)
+{
+	gint64 interval = (gint64)target->cur_interval * G_TIME_SPAN_MILLISECOND;
+	gint64 offset = (gint64)(target->phase_hash % target->cur_interval) * G_TIME_SPAN_MILLISECOND;
+	gint64 lag = (g_get_real_time() - offset) % interval;
+
+	return (lag < 0)? lag + interval : lag;
+}
+
+/*
+ * Arm the timer of the next check.  The next check is due one interval
+ * after the time the current one was due, not after the timer fired, so
+ * a late wakeup does not push back all the following checks.  Jitter
+ * moves only the timer, not the time the check after it is due.
+ */
+static void diskd_schedule(diskd_target_t *target)
+{
+	gint64 delay;
+
+	target->next_check = target->check_start
+		+ (gint64)target->cur_interval * G_TIME_SPAN_MILLISECOND;
+	delay = target->next_check - g_get_monotonic_time();
+	if (target->jitter > 0) {
+		delay += (gint64)target->cur_interval * G_TIME_SPAN_MILLISECOND / 100
+			* g_random_int_range(-target->jitter, target->jitter + 1);
+	}
+
+	if (target->timer_id != 0) {
+		g_source_remove(target->timer_id);
+	}
+	/* round up, the timer must not fire before the check is due */
+	target->timer_id = g_timeout_add((guint)((MAX(delay, 0) + 999) / 1000),
+		diskd_check_start, target);
+}
+
+/*
+ * Poll at the fast interval after a bad or unusually slow check, and back
+ * off by doubling the interval up to the maximum while the checks are good.
+ */
+static void diskd_adapt_interval(diskd_target_t *target, int result, gboolean anomaly)
+{
+	int next;
+
+	if (result != normal || anomaly) {
+		next = target->fast_interval;
+	} else {
+		next = MIN(target->cur_interval * 2, target->max_interval);
+	}
+	if (next == target->cur_interval) {
+		return;
+	}
+	crm_debug("check interval of %s is changed: %d -> %d msec",
+		target->name, target->cur_interval, next);
+	target->cur_interval = next;
+	diskd_schedule(target);
+}
+
+static void diskd_check_end(diskd_target_t *target, int result, gboolean anomaly)
+{
+	target->state = STATE_IDLE;
+	target->last_check = g_get_real_time();
+	target->checks++;
+	if (result == SLOW) {
+		target->slows++;
+	} else if (result == ERROR) {
+		target->errors++;
+		crm_warn("Error(s) occurred in the check of %s after %d attempt(s).",
+			(target->wfile)? target->wdir : target->device, target->attempt + 1);
+	}
+	diskd_report(target, result, TRUE);
+	diskd_adapt_interval(target, result, anomaly);
+}
+
+static gboolean diskd_probe_done(gpointer data)
+{
+	diskd_probe_t *probe = data;
+	diskd_target_t *target = probe->target;
+	diskd_hist_t *total = &target->hist[PHASE_TOTAL];
+	gboolean anomaly = FALSE;
+	int i;
+
+	diskd_watchdog_disarm(target);
+	if (target->removed) {	/* dropped by a reload while the check was running */
+		diskd_target_t *successor = diskd_find_target(targets, target->name);
+
+		if (successor && successor->borrowed) {
+			successor->borrowed = FALSE;
+			successor->state = STATE_IDLE;
+		}
+		free(probe);
+		target_free(target);
+		return FALSE;
+	}
+	for (i = 0; i < probe->nsamples; i++) {
+		diskd_hist_add(&target->hist[probe->samples[i].phase], probe->samples[i].usec);
+		if (probe->samples[i].phase == PHASE_TOTAL && probe->result == normal) {
+			probe->result = diskd_slow_check(target, probe->samples[i].usec);
+			anomaly = (total->count >= ANOMALY_MIN_CHECKS && probe->samples[i].usec
+				> ANOMALY_FACTOR * diskd_hist_quantile(total, 0.50));
+		}
+	}
+	diskd_event_probe(probe);
+	if (probe->result != ERROR && target->peer_slots > 0) {
+		diskd_peers_update(target);
+	}
+
+	if (probe->result == ERROR && target->attempt < target->retry) {
+		target->attempt++;
+		target->retries++;
+		target->state = STATE_RETRY_WAIT;
+		target->retry_id = g_timeout_add(diskd_retry_delay(target), diskd_retry_timer, target);
+	} else {
+		target->active_ok = (probe->result == normal);
+		diskd_check_end(target, probe->result, anomaly);
+	}
+	free(probe);
+	return FALSE;
+}
+
+static void diskd_probe_func(gpointer data, gpointer user_data)
+{
+	diskd_probe_t *probe = data;
+
+	diskd_thread_affinity();
+	diskd_set_ioprio(probe->target);
+	errno = 0;
+	probe->result = diskcheck_target(probe);
+	g_idle_add(diskd_probe_done, probe);
+}
+
+static gboolean diskd_attempt_start(diskd_target_t *target)
+{
+	diskd_probe_t *probe;
+	GError *gerr = NULL;
+
+	target->active_ok = FALSE;
+	target->passive_skips = 0;
+	probe = calloc(1, sizeof(diskd_probe_t));
+	if (probe == NULL) {
+		crm_err("Could not allocate memory");
+		diskd_check_end(target, ERROR, FALSE);
+		return FALSE;
+	}
+	probe->target = target;
+	target->state = STATE_PROBING;
+	target->probe_start = g_get_monotonic_time();
+
+	diskd_watchdog_arm(target);
+
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	if (g_thread_pool_push(probe_pool, probe, &gerr) == FALSE) {
+#else
+	g_thread_pool_push(probe_pool, probe, &gerr);
+	if (gerr != NULL) {
+#endif
+		crm_err("Cannot start the disk check of %s. %s", target->name, gerr->message);
+		g_error_free(gerr);
+		free(probe);
+		diskd_watchdog_disarm(target);
+		diskd_check_end(target, ERROR, FALSE);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static gboolean diskd_target_normal(diskd_target_t *target)
+{
+	gboolean rc;
+
+	diskd_status_lock();
+	rc = (target->value && strcmp(target->value, "normal") == 0);
+	diskd_status_unlock();
+	return rc;
+}
+
+static gboolean diskd_check_start(gpointer data)
+{
+	diskd_target_t *target = data;
+	gint64 now = g_get_monotonic_time();
+
+	target->timer_id = 0;
+	if (target->next_check == 0
+	    || now - target->next_check >= (gint64)target->cur_interval * G_TIME_SPAN_MILLISECOND) {
+		/*
+		 * The first check, or a whole interval was missed: check now and
+		 * put the following checks back on the phase of this target.
+		 */
+		target->check_start = now - diskd_phase_lag(target);
+	} else {
+		target->check_start = target->next_check;
+	}
+	diskd_schedule(target);
+
+	if (target->state == STATE_PROBING) {
+		/*
+		 * A hung check is left behind in its pool thread.  Another check
+		 * would only hang as well, so keep reporting ERROR until it returns.
+		 */
+		if (now - target->probe_start
+		    >= (gint64)target->timeout * G_TIME_SPAN_MILLISECOND) {
+			crm_warn("The check of %s has not finished in %d msec.",
+				(target->wfile)? target->wdir : target->device, target->timeout);
+			/* every interval missed by a hang is a failed check of its own */
+			diskd_report(target, ERROR, TRUE);
+		} else {
+			crm_warn("The previous check is still in progress. attr_name=%s", target->name);
+		}
+		return FALSE;
+	}
+	if (target->state == STATE_RETRY_WAIT) {
+		crm_trace("The previous check of %s is still retrying", target->name);
+		return FALSE;
+	}
+
+	/*
+	 * The device has completed I/O since the last check, nothing to ask.
+	 * Failed requests count as completed too, so this only holds while
+	 * the target is normal and its last active check passed; ERROR and
+	 * SLOW are only cleared by a check of our own.  A device failing every
+	 * request quickly is caught by the active check forced after
+	 * PASSIVE_MAX_SKIPS skipped ones.
+	 */
+	if (target->passive_ok && target->active_ok && target->passive_skips < PASSIVE_MAX_SKIPS
+	    && diskd_target_normal(target)) {
+		target->passive_skips++;
+		target->passive_ok = FALSE;
+		target->attempt = 0;
+		diskd_check_end(target, normal, FALSE);
+		return FALSE;
+	}
+
+	target->attempt = 0;
+	diskd_attempt_start(target);
+	return FALSE;
+}
+
+/* device number of a read target, FALSE if it is not a block device */
+static gboolean target_get_rdev(diskd_target_t *target)
+{
+	struct stat st;
+
+	if (target->rdev != 0) {
+		return TRUE;
+	}
+	if (target->wfile || target->device == NULL
+	    || stat(target->device, &st) < 0 || !S_ISBLK(st.st_mode)) {
+		return FALSE;
+	}
+	target->rdev = st.st_rdev;
+	return TRUE;
+}
+
+/* check a target out of its schedule, unless a check is already running */
+static void diskd_check_now(diskd_target_t *target, const char *why)
+{
+	if (target->state != STATE_IDLE) {
+		return;
+	}
+	crm_info("Checking %s now: %s", target->name, why);
+	target->passive_ok = FALSE;
+	target->attempt = 0;
+	diskd_attempt_start(target);
+}
+
+/*
+ * Kernel uevents.  A block device of a target being removed, changed or
+ * taken offline, or a path of a multipath map failing or coming back
+ * (DM_PATH), checks the target at once instead of at its next interval.
+ */
+static void diskd_uevent(char *buf, ssize_t len)
+{
+	const char *action = NULL;
+	const char *subsystem = NULL;
+	unsigned int maj = 0, min = 0, pmaj = 0, pmin = 0;
+	gboolean dev = FALSE, path = FALSE;
+	char why[64];
+	char *p;
+	GList *gIter;
+
+	buf[len - 1] = '\0';
+	for (p = buf; p < buf + len; p += strlen(p) + 1) {
+		if (strncmp(p, "ACTION=", 7) == 0) {
+			action = p + 7;
+		} else if (strncmp(p, "SUBSYSTEM=", 10) == 0) {
+			subsystem = p + 10;
+		} else if (strncmp(p, "MAJOR=", 6) == 0) {
+			dev = (sscanf(p + 6, "%u", &maj) == 1);
+		} else if (strncmp(p, "MINOR=", 6) == 0) {
+			dev = dev && (sscanf(p + 6, "%u", &min) == 1);
+		} else if (strncmp(p, "DM_PATH=", 8) == 0) {
+			path = (sscanf(p + 8, "%u:%u", &pmaj, &pmin) == 2);
+		}
+	}
+	if (action == NULL || subsystem == NULL || strcmp(subsystem, "block") != 0
+	    || (strcmp(action, "remove") != 0 && strcmp(action, "change") != 0
+		&& strcmp(action, "offline") != 0 && strcmp(action, "online") != 0)) {
+		return;
+	}
+	g_snprintf(why, sizeof(why), "uevent %s of %u:%u", action, maj, min);
+
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		if (target->rdev == 0) {
+			continue;
+		}
+		if ((dev && target->rdev == makedev(maj, min))
+		    || (path && target->rdev == makedev(pmaj, pmin))) {
+			diskd_check_now(target, why);
+		}
+	}
+}
+
+static gboolean diskd_uevent_read(GIOChannel *channel, GIOCondition condition, gpointer data)
+{
+	char buf[UEVENT_BUFFER_SIZE];
+	ssize_t len;
+
+	while ((len = recv(uevent_fd, buf, sizeof(buf), 0)) > 0) {
+		diskd_uevent(buf, len);
+	}
+	return TRUE;
 }
 
-static void diskd_thread_timer_end()
+/*
+ * The kernel uevents, or the datagrams sent to the socket given with -u
+ * in the same format, e.g. "ACTION=change\0SUBSYSTEM=block\0MAJOR=8\0MINOR=16\0".
+ */
+static gboolean diskd_uevent_init(void)
 {
-	if (diskd_thread_use == FALSE) return;
+	GIOChannel *channel;
 
-	diskd_thread_timer_variable_free();
+	if (uevent_path) {
+		struct sockaddr_un addr;
+		mode_t mask;
+
+		if (strlen(uevent_path) >= sizeof(addr.sun_path)) {
+			crm_err("uevent socket path %s is too long", uevent_path);
+			return FALSE;
+		}
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, uevent_path);
+		uevent_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		unlink(uevent_path);
+		mask = umask(0177);	/* only root may send */
+		if (uevent_fd < 0 || bind(uevent_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			crm_perror(LOG_ERR, "Could not listen for uevents on %s", uevent_path);
+			umask(mask);
+			return FALSE;
+		}
+		umask(mask);
+	} else {
+		struct sockaddr_nl addr;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.nl_family = AF_NETLINK;
+		addr.nl_groups = 1;	/* the kernel's own messages */
+		uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			NETLINK_KOBJECT_UEVENT);
+		if (uevent_fd < 0 || bind(uevent_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			crm_perror(LOG_ERR, "Could not listen for uevents");
+			return FALSE;
+		}
+	}
+	channel = g_io_channel_unix_new(uevent_fd);
+	g_io_add_watch(channel, G_IO_IN, diskd_uevent_read, NULL);
+	g_io_channel_unref(channel);
+	return TRUE;
 }
 
-static void diskd_thread_condsend()
+/*
+ * The mountinfo line of the file system holding the write directory of a
+ * target.  It changes when the file system is remounted read-only or
+ * unmounted, "" when the directory is gone.
+ */
+static char *diskd_mount_state(diskd_target_t *target, FILE *fp)
 {
-	gpointer ret_thread;
+	char real[PATH_MAX];
+	char line[PATH_MAX * 2];
+	char *best = NULL;
+	size_t best_len = 0;
 
-	if (diskd_thread_use == FALSE) return;
+	if (realpath(target->wdir, real) == NULL) {
+		return strdup("");
+	}
+	rewind(fp);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char mnt[PATH_MAX];
+		size_t len;
 
-#if GLIB_CHECK_VERSION(2, 32, 0)
-	g_mutex_lock(&diskd_mutex);
-	g_cond_broadcast(&diskd_cond);
-	g_mutex_unlock(&diskd_mutex);
-#else
-	if (diskd_mutex == NULL || diskd_cond == NULL) {
-		crm_warn("Cannot transmit cond to a thread");
+		if (sscanf(line, "%*d %*d %*s %*s %4095s", mnt) != 1) {
+			continue;
+		}
+		len = strlen(mnt);
+		if (strncmp(real, mnt, len) == 0
+		    && (real[len] == '/' || real[len] == '\0' || len == 1)
+		    && (best == NULL || len >= best_len)) {
+			free(best);
+			best = strdup(line);
+			best_len = len;
+		}
+	}
+	return (best)? best : strdup("");
+}
+
+/* check the write targets whose file system has changed */
+static void diskd_mounts_rescan(void)
+{
+	GList *gIter;
+	FILE *fp;
+
+	fp = fopen(mountinfo_path, "r");
+	if (fp == NULL) {
+		crm_perror(LOG_WARNING, "Could not open %s", mountinfo_path);
 		return;
 	}
-	g_mutex_lock(diskd_mutex);
-	g_cond_broadcast(diskd_cond);
-	g_mutex_unlock(diskd_mutex);
-#endif
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+		char *state;
 
-	if (th_timer != NULL) {
-		ret_thread = g_thread_join(th_timer);
-		crm_trace("thread_join -> %d", GPOINTER_TO_INT(ret_thread));
-		th_timer = NULL;
+		if (target->wfile == NULL) {
+			continue;
+		}
+		state = diskd_mount_state(target, fp);
+		if (target->mount_state && strcmp(state, target->mount_state) != 0) {
+			diskd_check_now(target, "the file system has changed");
+		}
+		free(target->mount_state);
+		target->mount_state = state;
 	}
+	fclose(fp);
 }
 
-static void diskd_thread_timer_func(gpointer data)
+static gboolean diskd_mounts_changed(GIOChannel *channel, GIOCondition condition, gpointer data)
 {
-	gboolean bret;
+	diskd_mounts_rescan();
+	return TRUE;
+}
 
-#if GLIB_CHECK_VERSION(2, 32, 0)
-	gint64 end_time;
+/* the kernel flags a change of the mount table with POLLPRI */
+static gboolean diskd_mounts_init(void)
+{
+	GIOChannel *channel;
 
-	g_mutex_lock(&thread_start_mutex);
+	mountinfo_fd = open(mountinfo_path, O_RDONLY | O_CLOEXEC);
+	if (mountinfo_fd < 0) {
+		crm_perror(LOG_ERR, "Could not open %s", mountinfo_path);
+		return FALSE;
+	}
+	diskd_mounts_rescan();
+	channel = g_io_channel_unix_new(mountinfo_fd);
+	g_io_add_watch(channel, G_IO_PRI | G_IO_ERR, diskd_mounts_changed, NULL);
+	g_io_channel_unref(channel);
+	return TRUE;
+}
 
-	/* Awaiting a start */
-	g_mutex_lock(&diskd_mutex);
+static gboolean diskd_events_init(void)
+{
+	GList *gIter;
 
-	/* A calculation of the waiting time */
-	end_time = g_get_monotonic_time() + timeout * G_TIME_SPAN_SECOND;
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		target_get_rdev(gIter->data);
+	}
+	if (mountinfo_path == NULL) {
+		mountinfo_path = strdup(MOUNTINFO_FILE);
+	}
+	return diskd_uevent_init() && diskd_mounts_init();
+}
 
-	g_cond_signal(&thread_start_cond);
+/*
+ * Passive check.  The I/O counters of every device are sampled from the
+ * diskstats file.  Requests in flight while the device is busy but
+ * completes nothing mean a stalled queue, which is reported as ERROR once
+ * it lasts the check timeout, between the active checks.  A device seen
+ * completing I/O without a stall since its last check is known to work,
+ * so that check is answered without issuing I/O of our own.
+ */
+static void diskd_passive_update(diskd_target_t *target, guint64 ios, guint inflight,
+	guint64 ticks, gint64 now)
+{
+	gboolean first = (target->passive_at == 0);
+	guint64 done = ios - target->passive_ios;
+	guint64 busy = ticks - target->passive_ticks;
 
-	g_mutex_unlock(&thread_start_mutex);
+	target->passive_ios = ios;
+	target->passive_ticks = ticks;
+	target->passive_at = now;
+	if (first) {
+		return;
+	}
 
-	bret = g_cond_wait_until(&diskd_cond, &diskd_mutex, end_time);
-	g_mutex_unlock(&diskd_mutex);
-#else
-	GTimeVal gtime;
-	glong add_time = (timeout) * 1000 * 1000;
+	if (done > 0) {
+		if (target->stall_since != 0) {
+			crm_notice("I/O of %s is completing again", target->device);
+		}
+		target->stall_since = 0;
+		target->passive_ok = TRUE;
+	} else if (inflight > 0 && busy > 0) {
+		if (target->stall_since == 0) {
+			target->stall_since = now;
+			target->passive_ok = FALSE;
+		} else if (now - target->stall_since
+			   >= (gint64)target->timeout * G_TIME_SPAN_MILLISECOND
+			   && target->stall_reported == FALSE) {
+			crm_warn("%u request(s) of %s have not completed for %d msec",
+				inflight, target->device, target->timeout);
+			target->stall_reported = TRUE;
+			diskd_event_stall(target);
+			diskd_report(target, ERROR, TRUE);
+		}
+		return;
+	} else if (inflight == 0) {
+		target->stall_since = 0;	/* idle */
+	}
+	if (target->stall_since == 0) {
+		target->stall_reported = FALSE;
+	}
+}
 
-	g_mutex_lock(thread_start_mutex);
+static gboolean diskd_passive_sample(gpointer data)
+{
+	gint64 now = g_get_monotonic_time();
+	char line[512];
+	FILE *fp;
 
-	/* Awaiting a start */
-	g_mutex_lock(diskd_mutex);
+	fp = fopen(diskstats_path, "r");
+	if (fp == NULL) {
+		crm_perror(LOG_WARNING, "Could not open %s", diskstats_path);
+		return TRUE;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		unsigned int maj, min, inflight;
+		unsigned long long reads, writes, ticks;
+		GList *gIter;
 
-	/* A calculation of the waiting time and practice of the timer.(mergin 1s) */
-	g_get_current_time(&gtime);
-	g_time_val_add(&gtime, add_time);
+		/* major minor name reads . . . writes . . . in_flight io_ticks ... */
+		if (sscanf(line, "%u %u %*s %llu %*u %*u %*u %llu %*u %*u %*u %u %llu",
+			   &maj, &min, &reads, &writes, &inflight, &ticks) != 6) {
+			continue;
+		}
+		for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+			diskd_target_t *target = gIter->data;
 
-	g_cond_signal(thread_start_cond);
+			if (target->passive && target->rdev == makedev(maj, min)) {
+				diskd_passive_update(target, reads + writes, inflight, ticks, now);
+			}
+		}
+	}
+	fclose(fp);
+	return TRUE;
+}
 
-	g_mutex_unlock(thread_start_mutex);
+static void diskd_passive_target(diskd_target_t *target)
+{
+	/* the slot of this node has to be written on every interval */
+	if (target->wfile || target->peer_slots > 0) {
+		return;
+	}
+	if (target_get_rdev(target) == FALSE) {
+		crm_warn("%s is not a block device, it is only checked actively",
+			target->device);
+		return;
+	}
+	target->passive = TRUE;
+}
 
-	bret = g_cond_timed_wait(diskd_cond, diskd_mutex, &gtime);
-	g_mutex_unlock(diskd_mutex);
-#endif
+static void diskd_passive_init(void)
+{
+	GList *gIter;
 
-	if (bret == FALSE){
-		crm_warn("Timeout Error(s) occurred in diskd timer thread.");
-		check_status(ERROR);
-		g_thread_exit(GINT_TO_POINTER(ERROR));
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_passive_target(gIter->data);
 	}
-	crm_trace("Received Cond from Main().");
-	g_thread_exit(GINT_TO_POINTER(normal));
+	diskd_passive_sample(NULL);
+	g_timeout_add(passive_interval, diskd_passive_sample, NULL);
 }
 
-static void diskd_thread_create()
+static void diskd_probe_init(void)
 {
 	GError *gerr = NULL;
 
-	if (diskd_thread_use == FALSE) return;
-
-#if GLIB_CHECK_VERSION(2, 32, 0)
-	g_mutex_lock(&thread_start_mutex);
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+	if (!g_thread_supported()) {
+		g_thread_init(NULL);
+	}
+#endif
+	probe_pool = g_thread_pool_new(diskd_probe_func, NULL, -1, FALSE, &gerr);
+	if (probe_pool == NULL) {
+		crm_err("Cannot create the probe pool. %s", gerr->message);
+		g_error_free(gerr);
+	}
+}
 
-	if (th_timer == NULL) {
-		th_timer = g_thread_try_new(NULL, (GThreadFunc)diskd_thread_timer_func, NULL, &gerr);
-		if (th_timer == NULL) {
-			crm_err("Cannot create diskd timer_thread. %s", gerr->message);
-			g_error_free(gerr);
-			diskd_thread_use = FALSE;
-			g_mutex_unlock(&thread_start_mutex);
-		}
+/* delete an attribute which no target sets any more */
+static void diskd_delete_attr(const char *name)
+{
+	if (name == NULL) {
+		return;
 	}
+	diskd_status_lock();
+	g_hash_table_remove(attr_sent, name);
+	g_hash_table_remove(attr_pending, name);
+	diskd_status_unlock();
+	crm_info("Deleting attribute %s", name);
+	send_delete(name);
+}
 
-	if (th_timer != NULL) {
-		g_cond_wait(&thread_start_cond, &thread_start_mutex);
-		g_mutex_unlock(&thread_start_mutex);
+/*
+ * Stop the checks of a target dropped by a reload.  Its attributes are
+ * deleted unless the target which replaces it sets them as well.
+ */
+static void diskd_target_stop(diskd_target_t *target, diskd_target_t *successor)
+{
+	if (target->timer_id != 0) {
+		g_source_remove(target->timer_id);
+		target->timer_id = 0;
 	}
-#else
-	g_mutex_lock(thread_start_mutex);
+	if (target->retry_id != 0) {
+		g_source_remove(target->retry_id);
+		target->retry_id = 0;
+	}
+	diskd_watchdog_disarm(target);
 
-	if (th_timer == NULL) {
-		th_timer = g_thread_create((GThreadFunc)diskd_thread_timer_func, NULL, TRUE, &gerr);
-		if (th_timer == NULL) {
-			crm_err("Cannot create diskd timer_thread. %s", gerr->message);
-			g_error_free(gerr);
-			diskd_thread_use = FALSE;
-			g_mutex_unlock(thread_start_mutex);
-		}
+	if (successor == NULL) {
+		diskd_delete_attr(target->name);
+	}
+	if (successor == NULL || successor->paths_attr == NULL) {
+		diskd_delete_attr(target->paths_attr);
 	}
+	if ((successor == NULL || successor->peer_slots == 0) && target->peers) {
+		int i;
 
-	if (th_timer != NULL) {
-		g_cond_wait(thread_start_cond, thread_start_mutex);
-		g_mutex_unlock(thread_start_mutex);
+		for (i = 0; i < target->peer_slots; i++) {
+			diskd_delete_attr(target->peers[i].attr);
+			diskd_delete_attr(target->peers[i].sees_attr);
+		}
+		diskd_delete_attr(target->peers_attr);
 	}
-#endif
 }
 
-static int diskcheck_wt(gpointer data)
+/*
+ * Reload the targets on SIGHUP.  A target whose name and specification
+ * have not changed goes on with its state, schedule and statistics.  New
+ * and changed targets start their checks, and the targets which are gone
+ * delete their attributes.  If the new targets are wrong, nothing changes.
+ */
+static void diskd_reload(int nsig)
 {
-	int fd = -1;
-	int err, i;
-	int select_err;
-	struct timeval timeout_tv;
-	fd_set write_fd_set;
+	GHashTable *kept;
+	GList *loaded;
+	GList *next = NULL;
+	GList *gIter;
 
-	crm_trace("diskcheck_wt start");
+	crm_notice("Reloading the targets");
+	loaded = diskd_load_targets();
+	if (loaded == NULL) {
+		crm_err("Reload failed, the targets are not changed");
+		return;
+	}
 
-	diskd_thread_create();
+	/* new target -> running target it is the same as */
+	kept = g_hash_table_new(g_direct_hash, g_direct_equal);
+	for (gIter = loaded; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+		diskd_target_t *old = diskd_find_target(targets, target->name);
 
-	for (i = 0; i <= retry; i++) {
-		if ( i != 0 ) {
-			sleep(retry_interval);
+		if (old && strcmp(old->spec, target->spec) == 0) {
+			g_hash_table_insert(kept, target, old);
+			next = g_list_append(next, old);
+		} else {
+			next = g_list_append(next, target);
 		}
+	}
 
-		/* file open */
-		fd = open(wfile, O_WRONLY | O_CREAT | O_DSYNC | O_NONBLOCK, 0);
-		if (fd == -1) {
-			crm_err("Could not open %s", wfile);
-			crm_perror(LOG_ERR, "%s", wfile);
-			continue;  /* failed to open file. try re-open */
-		}
+	/*
+	 * Stop the removed targets first: until they are disarmed the watchdog
+	 * may report a path to its multipath device, walking its paths.
+	 */
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
 
-		while( 1 ) {
-			err = write(fd, buf, WRITE_DATA);  /* data write */
-			if (err == WRITE_DATA) {
-				crm_trace("data writing is OK");
-				close(fd);
-				if (-1 == remove((const char *)wfile)) {
-					crm_warn("failed to remove file %s", wfile);
-				}
-				diskd_thread_condsend();
-				check_status(normal);
-				return normal;  /* OK */
-			} else if (err != WRITE_DATA && errno == EAGAIN) {
-				crm_warn("write function return errno:EAGAIN");
-				FD_ZERO(&write_fd_set);
-				FD_SET(fd, &write_fd_set);
-				timeout_tv.tv_sec = timeout;
-				timeout_tv.tv_usec = 0;
-				select_err = select(fd+1, NULL, &write_fd_set, NULL, &timeout_tv);
-				if (select_err == 1) {
-					crm_warn("select ok, write again");
-					continue;  /* retly write */
-				} else if (select_err == -1) {
-					crm_err("select failed on file %s", wfile);
-					close(fd);
-					if (-1 == remove((const char *)wfile)) {
-						crm_warn("failed to remove file %s", wfile);
-					}
-					break;  /* failed to select */
-				} else {
-					crm_err("select time out on file %s", wfile);
-					close(fd);
-					if (-1 == remove((const char *)wfile)) {
-						crm_warn("failed to remove file %s", wfile);
-					}
-					break;  /* failed to select */
-				}
-			} else {
-				crm_err("Could not write to file %s", wfile);
-				crm_perror(LOG_ERR, "%s", wfile);
-				close(fd);
-				if (-1 == remove((const char *)wfile)) {
-					crm_warn("failed to remove file %s", wfile);
-				}
-				break;  /* failed to write */
-			}
+		if (g_list_find(next, target) == NULL) {
+			crm_info("Removing target %s", target->name);
+			diskd_target_stop(target, diskd_find_target(next, target->name));
 		}
 	}
-	/* after for loop */
 
-	diskd_thread_condsend();
+	/* a new path may belong to a kept multipath device, link them again */
+	diskd_status_lock();
+	for (gIter = next; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
 
-	crm_warn("Error(s) occurred in diskcheck_wt function.");
-	check_status(ERROR);
+		g_list_free(target->paths);
+		target->paths = NULL;
+	}
+	for (gIter = next; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+		diskd_target_t *parent;
 
-	return ERROR;
-}
+		if (target->parent == NULL) {
+			continue;
+		}
+		parent = g_hash_table_lookup(kept, target->parent);
+		if (parent) {
+			target->parent = parent;
+		}
+		target->parent->paths = g_list_append(target->parent->paths, target);
+	}
+	diskd_status_unlock();
 
-static int diskcheck(gpointer data)
-{
-	int i;
-	int fd = -1;
-	int err;
-	int select_err;
-	struct timeval timeout_tv;
-	fd_set read_fd_set;
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+		diskd_target_t *successor;
 
-	crm_trace("diskcheck start");
+		if (g_list_find(next, target) != NULL) {
+			continue;
+		}
+		successor = diskd_find_target(next, target->name);
+		if (target->state == STATE_PROBING && successor) {
+			/*
+			 * The check of the old target may still use its file or
+			 * peer slot: the new one waits for it like for a check of
+			 * its own, and reports ERROR if it hangs.
+			 */
+			successor->state = STATE_PROBING;
+			successor->borrowed = TRUE;
+			successor->probe_start = target->probe_start;
+		}
+		if (target->state == STATE_PROBING && target->borrowed == FALSE) {
+			target->removed = TRUE;	/* freed when the check returns */
+		} else {
+			target_free(target);
+		}
+	}
+	for (gIter = loaded; gIter != NULL; gIter = gIter->next) {
+		if (g_hash_table_lookup(kept, gIter->data)) {
+			target_free(gIter->data);
+		}
+	}
+	g_hash_table_destroy(kept);
+	g_list_free(loaded);
 
-	diskd_thread_create();
+	g_list_free(targets);
+	targets = next;
+	if (status_path && diskd_status_file_open() == FALSE) {
+		/* the slots of the old file do not match the targets any more */
+		crm_err("The status file %s is closed", status_path);
+		diskd_status_file_close();
+	}
 
-	for (i = 0; i <= retry; i++) {
-		if ( i != 0 ) {
-			sleep(retry_interval);
-		}
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
 
-		fd = open((const char *)device, O_RDONLY | O_NONBLOCK, 0);
-		if (fd == -1) {
-			crm_err("Could not open device %s", device);
+		if (target->ptr != NULL) {	/* running */
 			continue;
 		}
-
-		err = ioctl(fd, BLKFLSBUF, 0);
-		if (err != 0) {
-			crm_err("ioctl error, Could not flush buffer");
-			close(fd);
+		crm_info("Starting target %s", target->name);
+		if (target_alloc_buffer(target) == FALSE) {
+			check_status(target, ERROR);
 			continue;
 		}
-
-		while( 1 ) {
-			err = read(fd, buf, pagesize);
-			if (err == pagesize) {
-				crm_trace("reading form data is OK");
-				close(fd);
-				diskd_thread_condsend();
-				check_status(normal);
-				return normal;
-			} else if (err != pagesize && errno == EAGAIN) {
-				crm_warn("read function return errno:EAGAIN");
-				FD_ZERO(&read_fd_set);
-				FD_SET(fd, &read_fd_set);
-				timeout_tv.tv_sec = timeout;
-				timeout_tv.tv_usec = 0;
-				select_err = select(fd+1, &read_fd_set, NULL, NULL, &timeout_tv);
-				if (select_err == 1) {
-					crm_warn("select ok, read again");
-					continue;
-				} else if (select_err == -1) {
-					crm_err("select failed on device %s", device);
-					close(fd);
-					break;
-				}
-			} else {
-				crm_err("Could not read from device %s", device);
-				close(fd);
-				break;
-			}
+		if (passive_interval > 0) {
+			diskd_passive_target(target);
+		}
+		if (events_flag) {
+			target_get_rdev(target);
 		}
+		diskd_check_start(target);
+	}
+	if (events_flag) {
+		diskd_mounts_rescan();
 	}
-	diskd_thread_condsend();
-
-	crm_warn("Error(s) occurred in diskcheck function.");
-	check_status(ERROR);
-
-	return ERROR;
 }
 
 static int oneshot(void)
 {
+	GList *gIter;
 	int rc = 0;
 
-	if ( wflag ) {	/* writer */
-		if (wfile == NULL) {
-			wdir = strdup(WRITE_DIR);
-			wfile = calloc(1, PATH_MAX);
-			g_snprintf(wfile, PATH_MAX, "%s/%s", WRITE_DIR, WRITE_FILE);
-		}
-		buf = (void *)malloc(WRITE_DATA);
-		if (buf == NULL) {
-			crm_err("Could not allocate memory");
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_probe_t probe;
+
+		memset(&probe, 0, sizeof(probe));
+		probe.target = gIter->data;
+		if (target_alloc_buffer(probe.target) == FALSE) {
 			crm_exit(1);
 		}
-		rc = diskcheck_wt(NULL);
-		free(wfile);
-	} else {	/* reader */
-		pagesize = getpagesize();
-		ptr = (void *)malloc(2 * pagesize);
-		if (ptr == NULL) {
-			crm_err("Could not allocate memory");
-			crm_exit(1);
+		probe.target->attempt = 0;
+		diskd_set_ioprio(probe.target);
+		while (1) {
+			probe.nsamples = 0;
+			probe.result = diskcheck_target(&probe);
+			if (probe.result == normal || probe.target->attempt >= probe.target->retry) {
+				break;
+			}
+			probe.target->attempt++;
+			g_usleep((gulong)diskd_retry_delay(probe.target) * 1000);
+		}
+		if (probe.result == ERROR) {
+			rc = ERROR;
 		}
-		buf = (void *)(((u_long)ptr + pagesize) & ~(pagesize-1));
-		rc = diskcheck(NULL);
-		free(ptr);
-	}
-
-	if (rc == ERROR) {
-		return ERROR;
 	}
-	return 0;
+	return rc;
 }
 
 int
@@ -606,6 +4251,7 @@ main(int argc, char **argv)
 	int flag;
 	char *pid_file = NULL;
 	gboolean daemonize = FALSE;
+	GList *gIter;
 
 #ifdef HAVE_GETOPT_H
 	int option_index = 0;
@@ -626,14 +4272,49 @@ main(int argc, char **argv)
 		{"oneshot", 0, 0, 'o'},			/* add option 2009.10.01 */
 		{"exec-thread", 0, 0, 'e'},		/* add option 2011.09.30 */
 		{"dampen", 1, 0, 'm'},
+		{"target", 1, 0, 'T'},
+		{"config-file", 1, 0, 'C'},
+		{"stats-interval", 1, 0, 's'},
+		{"slow-threshold", 1, 0, 'l'},
+		{"slow-window", 1, 0, 'L'},
+		{"fail-window", 1, 0, 'H'},
+		{"recover-window", 1, 0, 'K'},
+		{"io-priority", 1, 0, 'G'},
+		{"cpu-affinity", 1, 0, 'Y'},
+		{"watchdog-fifo", 1, 0, 'Z'},
+		{"refresh-interval", 1, 0, 'R'},
+		{"direct-read", 0, 0, 'U'},
+		{"scsi-probe", 1, 0, 'g'},
+		{"check-paths", 0, 0, 'P'},
+		{"passive-interval", 1, 0, 'A'},
+		{"diskstats-file", 1, 0, 'x'},
+		{"events", 0, 0, 'E'},
+		{"uevent-socket", 1, 0, 'u'},
+		{"mountinfo-file", 1, 0, 'y'},
+		{"samples", 1, 0, 'S'},
+		{"write-mode", 1, 0, 'W'},
+		{"retry-backoff", 1, 0, 'b'},
+		{"retry-jitter", 1, 0, 'j'},
+		{"fast-interval", 1, 0, 'f'},
+		{"max-interval", 1, 0, 'M'},
+		{"jitter", 1, 0, 'J'},
+		{"control-socket", 1, 0, 'c'},
+		{"status-file", 1, 0, 'F'},
 
 		{0, 0, 0, 0}
 	};
 #endif
+	/* run by every monitor, so answered before any other setup */
+	if (argc == 3 && (strcmp(argv[1], "-Q") == 0 || strcmp(argv[1], "--query") == 0)) {
+		return diskd_query(argv[2]);
+	}
+
 	pid_file = strdup(PID_FILE);
 	crm_system_name = strdup(basename(argv[0]));
 
 	mainloop_add_signal(SIGTERM, diskd_shutdown);
+	mainloop_add_signal(SIGUSR1, diskd_event_log);
+	mainloop_add_signal(SIGHUP, diskd_reload);
 
 	crm_log_init(basename(argv[0]), LOG_INFO, TRUE, FALSE, argc, argv, FALSE);
 
@@ -675,18 +4356,16 @@ main(int argc, char **argv)
 					++argerr;
 				break;
 			case 'I':
-				retry_interval = crm_parse_int(optarg, "1");
-				if ((retry_interval < MIN_RETRY_INTERVAL) || (retry_interval > MAX_RETRY_INTERVAL))
+				if (parse_msec_range(optarg, MIN_RETRY_INTERVAL, MAX_RETRY_INTERVAL,
+						&retry_interval) == FALSE)
 					++argerr;
 				break;
 			case 'i':
-				interval = crm_parse_int(optarg, "1");
-				if ((interval < MIN_INTERVAL) || (interval > MAX_INTERVAL))
+				if (parse_msec_range(optarg, MIN_INTERVAL, MAX_INTERVAL, &interval) == FALSE)
 					++argerr;
 				break;
 			case 't':
-				timeout = crm_parse_int(optarg, "1");
-				if ((timeout < MIN_TIMEOUT) || (timeout > MAX_TIMEOUT))
+				if (parse_msec_range(optarg, MIN_TIMEOUT, MAX_TIMEOUT, &timeout) == FALSE)
 					++argerr;
 				break;
 			case 'N':
@@ -702,8 +4381,6 @@ main(int argc, char **argv)
 				break;
 			case 'd':   /* add option 2009.4.17 */
 				wdir = strdup(optarg);
-				wfile = calloc(1, PATH_MAX);
-				g_snprintf(wfile, PATH_MAX, "%s/%s", optarg, WRITE_FILE);
 				break;
 			case 'o':   /* add option 2009.10.01 */
 				oneshot_flag =1;
@@ -717,6 +4394,118 @@ main(int argc, char **argv)
 				else
 					attr_dampen = strdup(optarg);
 				break;
+			case 'T':
+				target_specs = g_list_append(target_specs, strdup(optarg));
+				break;
+			case 'C':
+				free(config_path);
+				config_path = strdup(optarg);
+				break;
+			case 's':
+				if (parse_int_range(optarg, 0, MAX_STATS_INTERVAL, &stats_interval) == FALSE)
+					++argerr;
+				break;
+			case 'l':
+				if (parse_msec_range(optarg, MIN_SLOW_THRESHOLD, MAX_SLOW_THRESHOLD,
+						&slow_threshold) == FALSE)
+					++argerr;
+				break;
+			case 'L':
+				if (parse_int_range(optarg, MIN_SLOW_WINDOW, MAX_SLOW_WINDOW, &slow_window) == FALSE)
+					++argerr;
+				break;
+			case 'H':
+				if (parse_hysteresis(optarg, &fail_count, &fail_window) == FALSE)
+					++argerr;
+				break;
+			case 'K':
+				if (parse_hysteresis(optarg, &recover_count, &recover_window) == FALSE)
+					++argerr;
+				break;
+			case 'G':
+				if (parse_ioprio(optarg, &io_priority) == FALSE)
+					++argerr;
+				break;
+			case 'Y':
+				if (parse_cpus(optarg, &probe_cpus) == FALSE)
+					++argerr;
+				probe_cpus_set = TRUE;
+				break;
+			case 'Z':
+				if (parse_int_range(optarg, 0, 99, &watchdog_fifo) == FALSE)
+					++argerr;
+				break;
+			case 'R':
+				if (parse_int_range(optarg, 0, MAX_STATS_INTERVAL, &refresh_interval) == FALSE)
+					++argerr;
+				break;
+			case 'U':
+				direct_read = TRUE;
+				break;
+			case 'g':
+				if (parse_scsi_probe(optarg, &scsi_probe) == FALSE)
+					++argerr;
+				break;
+			case 'P':
+				check_paths = TRUE;
+				break;
+			case 'A':
+				if (parse_msec_range(optarg, MIN_INTERVAL, MAX_INTERVAL, &passive_interval) == FALSE)
+					++argerr;
+				break;
+			case 'x':
+				free(diskstats_path);
+				diskstats_path = strdup(optarg);
+				break;
+			case 'E':
+				events_flag = TRUE;
+				break;
+			case 'u':
+				free(uevent_path);
+				uevent_path = strdup(optarg);
+				break;
+			case 'y':
+				free(mountinfo_path);
+				mountinfo_path = strdup(optarg);
+				break;
+			case 'S':
+				if (parse_int_range(optarg, MIN_SAMPLES, MAX_SAMPLES, &samples) == FALSE)
+					++argerr;
+				break;
+			case 'W':
+				if (parse_write_mode(optarg, &write_mode) == FALSE)
+					++argerr;
+				break;
+			case 'b':
+				if (parse_int_range(optarg, MIN_RETRY_BACKOFF, MAX_RETRY_BACKOFF,
+						&retry_backoff) == FALSE)
+					++argerr;
+				break;
+			case 'j':
+				if (parse_int_range(optarg, MIN_RETRY_JITTER, MAX_RETRY_JITTER,
+						&retry_jitter) == FALSE)
+					++argerr;
+				break;
+			case 'f':
+				if (parse_msec_range(optarg, MIN_INTERVAL, MAX_INTERVAL, &fast_interval) == FALSE)
+					++argerr;
+				break;
+			case 'M':
+				if (parse_msec_range(optarg, MIN_INTERVAL, MAX_INTERVAL, &max_interval) == FALSE)
+					++argerr;
+				break;
+			case 'J':
+				if (parse_int_range(optarg, MIN_JITTER, MAX_JITTER, &check_jitter) == FALSE)
+					++argerr;
+				break;
+			case 'c':
+				free(control_path);
+				control_path = strdup(optarg);
+				break;
+			case 'F':
+				free(status_path);
+				status_path = strdup(optarg);
+				break;
 			case '?':
 				usage(crm_system_name, 1);
 				break;
@@ -739,74 +4528,146 @@ main(int argc, char **argv)
 		printf("\n");
 		argerr ++;
 	}
-	if ((argerr) || (optflag >= 2) || (device == NULL && wflag == FALSE)) {  /* add optflag 2008.10.24 */
-		/* "-N" + "-w" pattern and not "-N" + not "-w"*/
+	if ((argerr) || (optflag >= 2)
+	    || (device == NULL && wflag == FALSE && target_specs == NULL && config_path == NULL)) {  /* add optflag 2008.10.24 */
+		/* "-N" + "-w" pattern and not "-N" + not "-w" + not "-T" + not "-C" */
 		usage(crm_system_name, 1);
 	}
-	if ((device != NULL) && (wfile != NULL)) {
+	if ((device != NULL) && (wdir != NULL)) {
 		/* "-N" + "-d" pattern */
 		crm_warn("\"d\" option was ignored, because N option was specified.");
 	}
 
+	if (watchdog_fifo > 0 && exec_thread_flag == 0) {
+		crm_warn("\"Z\" option was ignored, because the watchdog runs with e option only.");
+	}
+	default_ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+	if (default_ioprio < 0) {
+		default_ioprio = 0;
+	}
+
+	targets = diskd_load_targets();
+	if (targets == NULL) {
+		++argerr;
+	}
+	if (argerr) {
+		usage(crm_system_name, 1);
+	}
+
+	pagesize = getpagesize();
+
 	if (oneshot_flag) {
 		int rc = 0;
 
 		free(pid_file);
 		rc = oneshot();
+		g_list_free_full(targets, target_free);
 		crm_exit(rc);
 	}
 
 	crm_make_daemon(crm_system_name, daemonize, pid_file);
+	attr_sent = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+	attr_pending = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
 	diskd_thread_timer_init();
+	diskd_probe_init();
 
-	if ( wflag ) {	/* writer */
-		if (wfile == NULL) {
-			wdir = strdup(WRITE_DIR);
-			wfile = calloc(1, PATH_MAX);
-			g_snprintf(wfile, PATH_MAX, "%s/%s", WRITE_DIR, WRITE_FILE);
-		}
-		buf = (void *)malloc(WRITE_DATA);
-		if (buf == NULL) {
-			crm_err("Could not allocate memory");
-			check_status(ERROR);
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		if (probe_pool == NULL || target_alloc_buffer(target) == FALSE) {
+			check_status(target, ERROR);
+			diskd_flush_updates(NULL);
 			crm_exit(1);
 		}
-		diskcheck_wt(NULL);
-		timer_id = g_timeout_add(interval*1000, diskcheck_wt, NULL);
-	} else {	/* reader */
-		pagesize = getpagesize();
-		ptr = (void *)malloc(2 * pagesize);
-		if (ptr == NULL) {
-			crm_err("Could not allocate memory");
-			check_status(ERROR);
-			crm_exit(1);
+	}
+	if (passive_interval > 0) {
+		if (diskstats_path == NULL) {
+			diskstats_path = strdup(DISKSTATS_FILE);
 		}
-		buf = (void *)(((u_long)ptr + pagesize) & ~(pagesize-1));
-		diskcheck(NULL);
-		timer_id = g_timeout_add(interval*1000, diskcheck, NULL);
+		diskd_passive_init();
+	}
+	if (events_flag && diskd_events_init() == FALSE) {
+		crm_exit(1);
+	}
+	if (status_path && diskd_status_file_open() == FALSE) {
+		crm_exit(1);
+	}
+	if (control_path && diskd_control_init() == FALSE) {
+		crm_exit(1);
+	}
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		diskd_check_start(target);
+	}
+	if (stats_interval > 0) {
+		g_timeout_add_seconds(stats_interval, diskd_stats_log, NULL);
+	}
+	if (refresh_interval > 0) {
+		g_timeout_add_seconds(refresh_interval, diskd_refresh_updates, NULL);
 	}
 
 	crm_info("Starting %s", crm_system_name);
 	mainloop = g_main_new(FALSE);
 	g_main_run(mainloop);
 
-	free(ptr);
-	free(pid_file);
-	if (wfile != NULL) {
-		free(wfile);
-	}
+	/*
+	 * Do not wait for the checks which are still running.  A thread stuck
+	 * in I/O must not delay the stop, it goes away with the process.
+	 */
+	g_thread_pool_free(probe_pool, TRUE, FALSE);
+	probe_pool = NULL;
+
+	diskd_stats_log(NULL);
 
 	diskd_thread_timer_end();
+	diskd_delete_attrs();
+	diskd_control_end();
+	diskd_status_file_close();
+	if (uevent_path && uevent_fd >= 0) {
+		unlink(uevent_path);
+	}
+
+	free(pid_file);
+	free(config_path);
+	g_list_free_full(target_specs, free);
+	free(control_path);
+	free(status_path);
+	free(diskstats_path);
+	free(uevent_path);
+	free(mountinfo_path);
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		if (target->state != STATE_PROBING) {	/* else still used by a hung check */
+			target_free(target);
+		}
+	}
+	g_list_free(targets);
+	targets = NULL;
 
 	crm_info("Exiting %s", crm_system_name);
 	return 0;
 }
 
-void
-send_update(void)
+gboolean
+send_delete(const char *name)
 {
-	if (pcmk_ok != attrd_update_delegate(NULL, 'U', NULL, diskd_attr,
-		diskcheck_value, attr_section, attr_set, attr_dampen, NULL, attr_options)) {
-		crm_err("Could not update %s=%s", diskd_attr, diskcheck_value);
+	if (pcmk_ok != attrd_update_delegate(NULL, 'D', NULL, name,
+		NULL, attr_section, attr_set, NULL, NULL, attr_options)) {
+		crm_err("Could not delete %s", name);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+gboolean
+send_update(const char *name, const char *value)
+{
+	if (pcmk_ok != attrd_update_delegate(NULL, 'U', NULL, name,
+		value, attr_section, attr_set, attr_dampen, NULL, attr_options)) {
+		crm_err("Could not update %s=%s", name, value);
+		return FALSE;
 	}
+	return TRUE;
 }